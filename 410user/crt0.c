@@ -10,10 +10,10 @@
 #include <assert.h>
 
 extern int main(int argc, char *argv[]);
-extern void install_autostack(void * stack_high, void * stack_low);
+extern void install_autostack(void * stack_high);
 
 void _main(int argc, char *argv[], void *stack_high, void *stack_low)
 {
-  install_autostack(stack_high, stack_low);
+  install_autostack(stack_high);
   exit(main(argc, argv));
 }
@@ -68,81 +68,6 @@ void queue_detach(queue_t** queue, queue_t* t) {
     t->prev->next = t->next;
 }
 
-int heap_init(heap_t* heap) {
-    return vector_init(heap, sizeof(heap_node_t), INITIAL_HEAP_SIZE);
-}
-
-int heap_insert(heap_t* heap, heap_node_t* node) {
-    if (vector_push(heap, node) != 0) {
-        return -1;
-    }
-    int cur = vector_size(heap) - 1;
-    while (cur != 0) {
-        int parent = ((cur - 1) >> 1);
-        heap_node_t* cn = (heap_node_t*)vector_at(heap, cur);
-        heap_node_t* pn = (heap_node_t*)vector_at(heap, parent);
-        if (cn->key >= pn->key) {
-            break;
-        }
-        heap_node_t t = *pn;
-        *pn = *cn;
-        *cn = t;
-        cur = parent;
-    }
-    return 0;
-}
-
-heap_node_t* heap_peak(heap_t* heap) {
-    return (vector_size(heap) == 0 ? NULL : (heap_node_t*)vector_at(heap, 0));
-}
-
-void heap_pop(heap_t* heap) {
-    int size = vector_size(heap);
-    if (size == 0) {
-        return;
-    }
-    *(heap_node_t*)vector_at(heap, 0) =
-        *(heap_node_t*)vector_at(heap, size - 1);
-    vector_pop(heap);
-    size--;
-    int cur = 0;
-    while (1) {
-        int lc = cur * 2 + 1;
-        int rc = lc + 1;
-        int small = cur;
-        heap_node_t* cn = (heap_node_t*)vector_at(heap, cur);
-        heap_node_t *ln, *rn, *sn = cn;
-        if (lc < size) {
-            ln = (heap_node_t*)vector_at(heap, lc);
-            if (ln->key < sn->key) {
-                small = lc;
-                sn = ln;
-            }
-        }
-        if (rc < size) {
-            rn = (heap_node_t*)vector_at(heap, rc);
-            if (rn->key < sn->key) {
-                small = rc;
-                sn = rn;
-            }
-        }
-        if (small == cur) {
-            break;
-        }
-        if (small == lc) {
-            heap_node_t t = *ln;
-            *ln = *cn;
-            *cn = t;
-            cur = lc;
-        } else {
-            heap_node_t t = *rn;
-            *rn = *cn;
-            *cn = t;
-            cur = rc;
-        }
-    }
-}
-
 rb_t rb_nil = {
     .color = RB_BLACK,
     .parent = &rb_nil,
@@ -161,6 +86,40 @@ rb_t* rb_find(rb_t* root, int key) {
     return NULL;
 }
 
+rb_t* rb_floor(rb_t* root, int key) {
+    rb_t* p = root;
+    rb_t* result = &rb_nil;
+    while (p != &rb_nil) {
+        if (p->key == key) {
+            return p;
+        }
+        if (p->key < key) {
+            result = p;
+            p = p->right;
+        } else {
+            p = p->left;
+        }
+    }
+    return result;
+}
+
+rb_t* rb_ceil(rb_t* root, int key) {
+    rb_t* p = root;
+    rb_t* result = &rb_nil;
+    while (p != &rb_nil) {
+        if (p->key == key) {
+            return p;
+        }
+        if (p->key > key) {
+            result = p;
+            p = p->left;
+        } else {
+            p = p->right;
+        }
+    }
+    return result;
+}
+
 /**
  * @brief left rotate on a node
  * @param root rbtree root
@@ -272,7 +231,8 @@ void rb_insert(rb_t** root, rb_t* node) {
 }
 
 /**
- * @brief move v to u's position
+ * @brief move v to u's position, rb_nil is shared by all rbtrees so its parent
+ * is never written
  * @param root rbtree root
  * @param u u
  * @param v v
@@ -285,7 +245,9 @@ static void rb_transplant(rb_t** root, rb_t* u, rb_t* v) {
     } else {
         u->parent->right = v;
     }
-    v->parent = u->parent;
+    if (v != &rb_nil) {
+        v->parent = u->parent;
+    }
 }
 
 rb_t* rb_min(rb_t* root) {
@@ -310,79 +272,87 @@ rb_t* rb_next(rb_t* node) {
 /**
  * @brief fixup after deletion
  * @param root rbtree root
- * @param node node
+ * @param node node, may be rb_nil
+ * @param parent parent of node, as rb_nil does not record it
  */
-static void rb_delete_fixup(rb_t** root, rb_t* node) {
+static void rb_delete_fixup(rb_t** root, rb_t* node, rb_t* parent) {
     while (node != *root && node->color == RB_BLACK) {
-        if (node == node->parent->left) {
-            rb_t* r = node->parent->right;
+        if (node == parent->left) {
+            rb_t* r = parent->right;
             if (r->color == RB_RED) {
                 r->color = RB_BLACK;
-                node->parent->color = RB_RED;
-                rb_rotate_left(root, node->parent);
-                r = node->parent->right;
+                parent->color = RB_RED;
+                rb_rotate_left(root, parent);
+                r = parent->right;
             }
             if (r->left->color == RB_BLACK && r->right->color == RB_BLACK) {
                 r->color = RB_RED;
-                node = node->parent;
+                node = parent;
+                parent = node->parent;
             } else {
                 if (r->right->color == RB_BLACK) {
                     r->left->color = RB_BLACK;
                     r->color = RB_RED;
                     rb_rotate_right(root, r);
-                    r = node->parent->right;
+                    r = parent->right;
                 }
-                r->color = node->parent->color;
-                node->parent->color = RB_BLACK;
+                r->color = parent->color;
+                parent->color = RB_BLACK;
                 r->right->color = RB_BLACK;
-                rb_rotate_left(root, node->parent);
+                rb_rotate_left(root, parent);
                 node = *root;
             }
         } else {
-            rb_t* l = node->parent->left;
+            rb_t* l = parent->left;
             if (l->color == RB_RED) {
                 l->color = RB_BLACK;
-                node->parent->color = RB_RED;
-                rb_rotate_right(root, node->parent);
-                l = node->parent->left;
+                parent->color = RB_RED;
+                rb_rotate_right(root, parent);
+                l = parent->left;
             }
             if (l->right->color == RB_BLACK && l->left->color == RB_BLACK) {
                 l->color = RB_RED;
-                node = node->parent;
+                node = parent;
+                parent = node->parent;
             } else {
                 if (l->left->color == RB_BLACK) {
                     l->right->color = RB_BLACK;
                     l->color = RB_RED;
                     rb_rotate_left(root, l);
-                    l = node->parent->left;
+                    l = parent->left;
                 }
-                l->color = node->parent->color;
-                node->parent->color = RB_BLACK;
+                l->color = parent->color;
+                parent->color = RB_BLACK;
                 l->left->color = RB_BLACK;
-                rb_rotate_right(root, node->parent);
+                rb_rotate_right(root, parent);
                 node = *root;
             }
         }
     }
-    node->color = RB_BLACK;
+    if (node != &rb_nil) {
+        node->color = RB_BLACK;
+    }
 }
 
 void rb_delete(rb_t** root, rb_t* node) {
-    rb_t *x, *y = node;
+    rb_t *x, *xp, *y = node;
     int orig_color = y->color;
     if (node->left == &rb_nil) {
         x = node->right;
+        xp = node->parent;
         rb_transplant(root, node, x);
     } else if (node->right == &rb_nil) {
         x = node->left;
+        xp = node->parent;
         rb_transplant(root, node, x);
     } else {
         y = rb_min(node->right);
         orig_color = y->color;
         x = y->right;
         if (y->parent == node) {
-            x->parent = y;
+            xp = y;
         } else {
+            xp = y->parent;
             rb_transplant(root, y, y->right);
             y->right = node->right;
             y->right->parent = y;
@@ -393,7 +363,7 @@ void rb_delete(rb_t** root, rb_t* node) {
         y->color = node->color;
     }
     if (orig_color == RB_BLACK) {
-        rb_delete_fixup(root, x);
+        rb_delete_fixup(root, x, xp);
     }
 }
 
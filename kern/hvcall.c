@@ -32,6 +32,7 @@
 #include <sched.h>
 #include <sync.h>
 #include <timer.h>
+#include <tlb.h>
 #include <usermem.h>
 
 /** reference a page table to prevent hypevisor of freeing its shadow page table
@@ -352,22 +353,18 @@ static pv_pd_t* translate_pv_pd(pv_t* pv, pa_t pd, int wp) {
     if (pv_pd == NULL) {
         goto alloc_pv_pd_fail;
     }
+    /* no need to zero page directories, they are fully written from t_pd and
+     * t_user_pd on both success and failure */
     pa_t cr3 = alloc_user_pages(1);
     if (cr3 == BAD_PA) {
         goto alloc_cr3_fail;
     }
-    int old_if = save_clear_if();
-    memset((void*)map_phys_page(cr3, NULL), 0, PAGE_SIZE);
-    restore_if(old_if);
 
     pa_t user_cr3 = alloc_user_pages(1);
     if (user_cr3 == BAD_PA) {
         free_user_pages(cr3, 1);
         goto alloc_user_cr3_fail;
     }
-    old_if = save_clear_if();
-    memset((void*)map_phys_page(user_cr3, NULL), 0, PAGE_SIZE);
-    restore_if(old_if);
 
     memset(t_pd, 0, PAGE_SIZE);
     memset(t_user_pd, 0, PAGE_SIZE);
@@ -376,14 +373,14 @@ static pv_pd_t* translate_pv_pd(pv_t* pv, pa_t pd, int wp) {
         (*t_pd)[i] = (*kernel_pd)[i];
         (*t_user_pd)[i] = (*kernel_pd)[i];
     }
-    old_if = save_clear_if();
+    int old_if = save_clear_if();
     if (pd >= mem_limit) {
         goto bad_pt;
     }
     pd += pv->mem_base; /** convert guest physical address to host physical
                            address */
     for (i = 0; i < NUM_PAGE_ENTRY - USER_PD_START; i++) {
-        page_directory_t* old_pd = (page_directory_t*)map_phys_page(pd, NULL);
+        page_directory_t* old_pd = (page_directory_t*)map_phys_page(pd);
         pde_t old_pde = (*old_pd)[i];
         if ((old_pde & (PTE_PRESENT << PTE_P_SHIFT)) == 0) {
             continue;
@@ -393,7 +390,7 @@ static pv_pd_t* translate_pv_pd(pv_t* pv, pa_t pd, int wp) {
             goto bad_pt;
         }
         pt_pa += pv->mem_base;
-        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
+        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa);
         int old_pde_us = (old_pde & (1 << PTE_US_SHIFT));
         int j;
         for (j = 0; j < NUM_PAGE_ENTRY; j++) {
@@ -445,8 +442,8 @@ static pv_pd_t* translate_pv_pd(pv_t* pv, pa_t pd, int wp) {
             goto alloc_pt_fail;
         }
         /** write the new page table */
-        memcpy((void*)map_phys_page(new_pt, NULL), t_pt, PAGE_SIZE);
-        memcpy((void*)map_phys_page(new_user_pt, NULL), t_user_pt, PAGE_SIZE);
+        memcpy((void*)map_phys_page(new_pt), t_pt, PAGE_SIZE);
+        memcpy((void*)map_phys_page(new_user_pt), t_user_pt, PAGE_SIZE);
         pde_t new_pde = ((old_pde & PDE_RESV_MASK) |
                          (PTE_USER << PTE_US_SHIFT) | (1 << PTE_P_SHIFT));
         if (wp == 0) {
@@ -458,8 +455,8 @@ static pv_pd_t* translate_pv_pd(pv_t* pv, pa_t pd, int wp) {
         (*t_pd)[USER_PD_START + i] = (new_pt | new_pde);
         (*t_user_pd)[USER_PD_START + i] = (new_user_pt | new_pde);
     }
-    memcpy((void*)map_phys_page(cr3, NULL), t_pd, PAGE_SIZE);
-    memcpy((void*)map_phys_page(user_cr3, NULL), t_user_pd, PAGE_SIZE);
+    memcpy((void*)map_phys_page(cr3), t_pd, PAGE_SIZE);
+    memcpy((void*)map_phys_page(user_cr3), t_user_pd, PAGE_SIZE);
     restore_if(old_if);
     sfree(temp_space, 4 * PAGE_SIZE);
     pv_pd->guest_pd = pd;
@@ -471,8 +468,8 @@ static pv_pd_t* translate_pv_pd(pv_t* pv, pa_t pd, int wp) {
 
 bad_pt:
 alloc_pt_fail:
-    memcpy((void*)map_phys_page(cr3, NULL), t_pd, PAGE_SIZE);
-    memcpy((void*)map_phys_page(user_cr3, NULL), t_user_pd, PAGE_SIZE);
+    memcpy((void*)map_phys_page(cr3), t_pd, PAGE_SIZE);
+    memcpy((void*)map_phys_page(user_cr3), t_user_pd, PAGE_SIZE);
     restore_if(old_if);
     destroy_pd(cr3);
     destroy_pd(user_cr3);
@@ -489,6 +486,12 @@ static void hvcall_adjustpg(stack_frame_t* f) {
     thread_t* t = get_current();
     pv_t* pv = t->process->pv;
     pv_pd_t* pv_pd = pv->active_shadow_pd;
+    if (pv_pd->cr3 == pv_pd->user_cr3) {
+        /* boot page directory is not built from guest page tables and may map
+         * guest memory by huge pages, there is nothing to adjust
+         */
+        return;
+    }
     reg_t esp = f->esp;
     va_t addr;
     if (copy_from_user(esp, sizeof(va_t), &addr) != 0) {
@@ -502,11 +505,11 @@ static void hvcall_adjustpg(stack_frame_t* f) {
     pa_t pt_pa, user_pt_pa;
     int old_if = save_clear_if();
     page_directory_t* old_pd =
-        (page_directory_t*)map_phys_page(pv_pd->guest_pd, NULL);
+        (page_directory_t*)map_phys_page(pv_pd->guest_pd);
     pde_t old_pde = (*old_pd)[get_pd_index(addr)];
     if ((old_pde & (1 << PTE_P_SHIFT)) == 0) {
         page_directory_t* pd =
-            (page_directory_t*)map_phys_page(pv_pd->cr3, NULL);
+            (page_directory_t*)map_phys_page(pv_pd->cr3);
         pde_t* pde = &(*pd)[get_pd_index(addr) + USER_PD_START];
         if (*pde != BAD_PDE) {
             pt_pa = get_page_table(*pde);
@@ -514,7 +517,7 @@ static void hvcall_adjustpg(stack_frame_t* f) {
             free_user_pages(pt_pa, 1);
         }
         page_directory_t* user_pd =
-            (page_directory_t*)map_phys_page(pv_pd->user_cr3, NULL);
+            (page_directory_t*)map_phys_page(pv_pd->user_cr3);
         pde_t* user_pde = &(*user_pd)[get_pd_index(addr) + USER_PD_START];
         if (*user_pde != BAD_PDE) {
             user_pt_pa = get_page_table(*user_pde);
@@ -530,33 +533,31 @@ static void hvcall_adjustpg(stack_frame_t* f) {
             new_pde |= (old_pde & (1 << PTE_RW_SHIFT));
         }
         page_directory_t* pd =
-            (page_directory_t*)map_phys_page(pv_pd->cr3, NULL);
+            (page_directory_t*)map_phys_page(pv_pd->cr3);
         pde_t* pde = &(*pd)[get_pd_index(addr) + USER_PD_START];
         if (*pde != BAD_PDE) {
             pt_pa = get_page_table(*pde);
             *pde = (pt_pa | new_pde);
         } else {
-            pt_pa = alloc_user_pages(1);
+            pt_pa = alloc_zeroed_user_page();
             if (pt_pa == BAD_PA) {
                 goto alloc_pt_fail;
             }
-            memset((void*)map_phys_page(pt_pa, NULL), 0, PAGE_SIZE);
-            map_phys_page(pv_pd->cr3, NULL);
+            map_phys_page(pv_pd->cr3);
             *pde = (pt_pa | new_pde);
         }
         page_directory_t* user_pd =
-            (page_directory_t*)map_phys_page(pv_pd->user_cr3, NULL);
+            (page_directory_t*)map_phys_page(pv_pd->user_cr3);
         pde_t* user_pde = &(*user_pd)[get_pd_index(addr) + USER_PD_START];
         if (*user_pde != BAD_PDE) {
             user_pt_pa = get_page_table(*user_pde);
             *user_pde = (user_pt_pa | new_pde);
         } else {
-            user_pt_pa = alloc_user_pages(1);
+            user_pt_pa = alloc_zeroed_user_page();
             if (user_pt_pa == BAD_PA) {
                 goto alloc_pt_fail;
             }
-            memset((void*)map_phys_page(user_pt_pa, NULL), 0, PAGE_SIZE);
-            map_phys_page(pv_pd->user_cr3, NULL);
+            map_phys_page(pv_pd->user_cr3);
             *user_pde = (user_pt_pa | new_pde);
         }
         pa_t old_pt_pa = get_page_table(old_pde);
@@ -564,7 +565,7 @@ static void hvcall_adjustpg(stack_frame_t* f) {
             goto bad_pt;
         }
         old_pt_pa += pv->mem_base;
-        page_table_t* old_pt = (page_table_t*)map_phys_page(old_pt_pa, NULL);
+        page_table_t* old_pt = (page_table_t*)map_phys_page(old_pt_pa);
         pte_t old_pte = (*old_pt)[get_pt_index(addr)];
         pte_t pte, user_pte;
         if ((old_pte & (PTE_PRESENT << PTE_P_SHIFT)) == 0) {
@@ -599,13 +600,14 @@ static void hvcall_adjustpg(stack_frame_t* f) {
                             : ((pa & PAGE_BASE_MASK) |
                                (old_pte & PTE_RESV_MASK) | new_user_mask));
         }
-        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
+        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa);
         (*pt)[get_pt_index(addr)] = pte;
-        page_table_t* user_pt = (page_table_t*)map_phys_page(user_pt_pa, NULL);
+        page_table_t* user_pt = (page_table_t*)map_phys_page(user_pt_pa);
         (*user_pt)[get_pt_index(addr)] = user_pte;
     }
     restore_if(old_if);
-    invlpg(addr + USER_MEM_START);
+    tlb_shootdown(pv_pd->cr3, addr + USER_MEM_START, 1);
+    tlb_shootdown(pv_pd->user_cr3, addr + USER_MEM_START, 1);
     return;
 
 bad_pt:
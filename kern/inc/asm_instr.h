@@ -17,9 +17,29 @@
  */
 void invlpg(va_t va);
 
+/**
+ * @brief runs mfence
+ */
+void mfence();
+
 /**
  * @brief runs hlt
  */
 void hlt();
 
+/**
+ * @brief divide a 64 bit integer by a 32 bit one in place, so no 64 bit
+ * division helper of the compiler is needed
+ * @param n the dividend, replaced by the quotient
+ * @param d the divisor, must not be 0
+ * @return the remainder
+ */
+uint32_t div64_32(uint64_t* n, uint32_t d);
+
+/**
+ * @brief enable interrupts and halt until the next one, an interrupt pending
+ * when called is not missed
+ */
+void sti_hlt();
+
 #endif
@@ -85,6 +85,22 @@ extern rb_t rb_nil;
  */
 rb_t* rb_find(rb_t* root, int key);
 
+/**
+ * @brief find the node with the greatest key not greater than key
+ * @param root rbtree root
+ * @param key key to compare
+ * @return rb_nil if no such node exist, otherwise the node
+ */
+rb_t* rb_floor(rb_t* root, int key);
+
+/**
+ * @brief find the node with the smallest key not less than key
+ * @param root rbtree root
+ * @param key key to compare
+ * @return rb_nil if no such node exist, otherwise the node
+ */
+rb_t* rb_ceil(rb_t* root, int key);
+
 /**
  * @brief insert a node to rbtree
  * @param root rbtree root
@@ -178,51 +194,4 @@ void* vector_at(vector_t* v, int index);
  */
 void vector_free(vector_t* v);
 
-/**
- * a node in heap
- */
-typedef struct heap_node_s {
-    int key;
-    void* value;
-} heap_node_t;
-
-/**
- * a minimum heap
- */
-typedef vector_t heap_t;
-
-/**
- * heap is only used for timer and we choose this size because 8 is a common
- * number in computer science and no other size make more sense than this one
- */
-#define INITIAL_HEAP_SIZE (8)
-
-/**
- * @brief initializa a heap
- * @param heap the heap
- * @return -1 on failure, 0 on success
- */
-int heap_init(heap_t* heap);
-
-/**
- * @brief insert a node into heap
- * @param heap the heap
- * @param node the node
- * @return -1 on failure, 0 on success
- */
-int heap_insert(heap_t* heap, heap_node_t* node);
-
-/**
- * @brief peak the top of a heap
- * @param heap the heap
- * @return top node of the heap or NULL if heap is empty
- */
-heap_node_t* heap_peak(heap_t* heap);
-
-/**
- * @brief remove the top node from heap
- * @param heap the heap
- */
-void heap_pop(heap_t* heap);
-
 #endif
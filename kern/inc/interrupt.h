@@ -12,6 +12,8 @@
 #include <x86/seg.h>
 
 #include <paging.h>
+#include <syscall_ext_int.h>
+#include <syscall_int.h>
 
 /**
  * IRQ # of timer
@@ -58,6 +60,13 @@ typedef struct idt_s {
 
 #define IDT_FAULT_15 15
 
+/** page fault error code bit, the fault is caused by a write */
+#define PF_ERR_WRITE 2
+
+/** number of pages populated in one ZFOD fault, must be a power of 2 and no
+ * more than a page table */
+#define FAULT_AROUND_PAGES 8
+
 /**
  * @brief create an idt entry
  * @param eip eip
@@ -11,6 +11,8 @@
 
 #include <exec2obj.h>
 
+#include <mm.h>
+
 /* --- Prototypes --- */
 
 /**
@@ -43,4 +45,45 @@ int read_file(file_t* f, int offset, int size, char* buf);
  */
 file_t* find_file(const char* name);
 
+/** file content mapped at a virtual address */
+typedef struct file_map_s {
+    /** file entry, NULL if there is no file content */
+    file_t* f;
+    /** offset of content in file */
+    int f_off;
+    /** length of content */
+    int f_len;
+    /** virtual address of content */
+    va_t m_off;
+} file_map_t;
+
+/**
+ * @brief check if a page contains any file content
+ * @param fm file mapping
+ * @param va page aligned virtual address
+ * @return nonzero if part of the page comes from file
+ */
+static inline int is_file_page(const file_map_t* fm, va_t va) {
+    return (fm->f != NULL && va < fm->m_off + fm->f_len &&
+            va + PAGE_SIZE > fm->m_off);
+}
+
+/**
+ * @brief copy file content of a page to a zeroed physical page
+ * @param fm file mapping
+ * @param va page aligned virtual address
+ * @param pa physical page
+ */
+void read_file_page(const file_map_t* fm, va_t va, pa_t pa);
+
+/**
+ * @brief get the frame holding a page of read only file content, the frame is
+ * loaded on first use and shared by all processes mapping the same content
+ * @param fm file mapping
+ * @param va page aligned virtual address, is_file_page() must be true
+ * @return physical address of the page with one reference taken for caller,
+ * BAD_PA on failure
+ */
+pa_t get_shared_file_page(const file_map_t* fm, va_t va);
+
 #endif /* _LOADER_H */
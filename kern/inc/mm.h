@@ -21,7 +21,38 @@
 extern mutex_t malloc_lock;
 
 /** lock for user memory management */
-extern mutex_t mm_lock;
+extern spl_t mm_lock;
+
+/** a read only page filled with zeros, mapped for reads of untouched memory */
+extern pa_t zero_page;
+
+/** order of a huge page in the buddy system */
+#define HUGE_PAGE_ORDER 10
+/** number of pages in a huge page, which is mapped by a page directory entry */
+#define HUGE_PAGE_PAGES (1 << HUGE_PAGE_ORDER)
+
+/** number of free pages a CPU can cache */
+#define PAGE_CACHE_SIZE 64
+/** number of pages moved between a CPU's cache and the global pool at once */
+#define PAGE_CACHE_BATCH 32
+
+/** per-CPU cache of free single pages */
+typedef struct page_cache_s {
+    int count;
+    int pages[PAGE_CACHE_SIZE]; /* physical page numbers */
+} page_cache_t;
+
+/** number of physical page mapping slots of a CPU */
+#define KMAP_SLOTS 8
+
+/** per-CPU physical page mapping slots, a slot keeps its mapping after it is
+ * released so frames touched again are found without remapping */
+typedef struct kmap_s {
+    pa_t pa[KMAP_SLOTS];              /* frame in each slot, BAD_PA if none */
+    int refcount[KMAP_SLOTS];         /* nested users of each slot */
+    unsigned int last_use[KMAP_SLOTS]; /* clock of last use for LRU */
+    unsigned int clock;               /* increased on every use */
+} kmap_t;
 
 /**
  * @brief initialize user memory system
@@ -43,13 +74,102 @@ pa_t alloc_user_pages(int num_pages);
 void free_user_pages(pa_t pa, int num_pages);
 
 /**
- * @brief map a physical page to kernel memory, the mapping area will be reused
- * after subsequent map_phys_page() calls
+ * @brief allocate a huge page aligned to its size, the content is not cleared,
+ * the page is referenced and freed as a whole by get_user_page() and
+ * put_user_page()
+ * @return physical address of the huge page, or BAD_PA on failure
+ */
+pa_t alloc_huge_user_page();
+
+/**
+ * @brief allocate a zero filled page, pre-zeroed pages are used first
+ * @return physical address of the page, or BAD_PA on failure
+ */
+pa_t alloc_zeroed_user_page();
+
+/**
+ * @brief allocate a batch of zero filled single pages, the pre-zeroed pool is
+ * drained with one lock acquisition and only the remainder is cleared here
+ * @param pages array to receive physical addresses of the pages
+ * @param num_pages number of pages
+ * @return 0 on success, -1 on failure, no page is held on failure
+ */
+int alloc_zeroed_user_pages(pa_t* pages, int num_pages);
+
+/**
+ * @brief fill newly allocated pages with zeros, pages already zeroed by idle
+ * CPUs are skipped
+ * @param pa physical address of pages
+ * @param num_pages number of pages
+ */
+void zero_user_pages(pa_t pa, int num_pages);
+
+/**
+ * @brief zero some free pages for later use, called by idle CPUs
+ * @return 1 if more pages can be zeroed, 0 if there is nothing left to do
+ */
+int refill_zeroed_pages();
+
+/**
+ * @brief add a reference to a user page, used when a page is shared by
+ * copy-on-write mappings
+ * @param pa physical address of the page
+ */
+void get_user_page(pa_t pa);
+
+/**
+ * @brief drop a reference to a user page, the page is freed when the last
+ * reference is dropped
+ * @param pa physical address of the page
+ */
+void put_user_page(pa_t pa);
+
+/**
+ * @brief drop a reference to every page mapped by a user page table which is
+ * no longer in any page directory, and then to the page table itself
+ * @param pt physical address of the page table
+ */
+void put_user_pt(pa_t pt);
+
+/**
+ * @brief get the reference count of a user page
+ * @param pa physical address of the page
+ * @return number of mappings referencing the page
+ */
+int get_user_page_refcount(pa_t pa);
+
+/**
+ * @brief adjust the number of present entries recorded for a user page table,
+ * the caller must hold the owner's mm_lock
+ * @param pt physical address of the page table
+ * @param delta change of the number
+ * @return number of present entries after the change
+ */
+int adjust_pt_entries(pa_t pt, int delta);
+
+/**
+ * @brief map a physical page to kernel memory and hold the mapping, a frame
+ * already in a slot is reused without remapping, otherwise the least recently
+ * used free slot is taken, interrupts must be disabled until kunmap()
+ * @param pa physcial address of the page
+ * @return virtual address of mapped page
+ */
+va_t kmap(pa_t pa);
+
+/**
+ * @brief release a mapping from kmap(), the frame stays mapped until its slot
+ * is reused
+ * @param va virtual address returned by kmap()
+ */
+void kunmap(va_t va);
+
+/**
+ * @brief map a physical page to kernel memory without holding it, the mapping
+ * is valid until KMAP_SLOTS - 1 other frames are mapped on this CPU, so
+ * interrupts must be disabled while it is used
  * @param pa physcial address of the page
- * @param old_pa output argument to save old mapped page, can be NULL if no need
- * to save
  * @return virtual address of mapped page
  */
-va_t map_phys_page(pa_t pa, pa_t* old_pa);
+va_t map_phys_page(pa_t pa);
 
 #endif
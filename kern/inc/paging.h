@@ -70,8 +70,17 @@ typedef unsigned int reg_t;
 #define PTE_PWT_SHIFT 3
 /** PCD bit's position */
 #define PTE_PCD_SHIFT 4
+/** PS bit's position in a page directory entry */
+#define PDE_PS_SHIFT 7
 /** G bit's position */
 #define PTE_G_SHIFT 8
+/** first available bit's position, marks a copy-on-write page */
+#define PTE_COW_SHIFT 9
+
+/** means a page is shared read-only and copied on first write */
+#define PTE_COW 1
+/** means a page directory entry maps a 4MB page instead of a page table */
+#define PDE_PS 1
 
 /** an invalid page directory entry */
 #define BAD_PDE ((pde_t)0)
@@ -113,6 +122,21 @@ static inline pde_t make_pde(pa_t base, int us, int rw, int p) {
 /** size of memory a page table can manage */
 #define PT_SIZE (PAGE_SIZE * NUM_PAGE_ENTRY)
 
+/**
+ * @brief create a page directory entry mapping a 4MB page
+ * @param base address of the 4MB page
+ * @param g g bit
+ * @param us user/supervisor bit
+ * @param rw rw/ro bit
+ * @param p present bit
+ * @return the page directory entry
+ */
+static inline pde_t make_large_pde(pa_t base, int g, int us, int rw, int p) {
+    return ((base & (~(PT_SIZE - 1))) | (PDE_PS << PDE_PS_SHIFT) |
+            (g << PTE_G_SHIFT) | (us << PTE_US_SHIFT) | (rw << PTE_RW_SHIFT) |
+            (p << PTE_P_SHIFT));
+}
+
 /** page directory type */
 typedef pde_t page_directory_t[PAGE_SIZE / sizeof(pde_t)];
 /** page table type */
@@ -128,6 +152,16 @@ static inline pa_t get_page_base(pte_t pte) {
     return (pa_t)(pte & PAGE_BASE_MASK);
 }
 
+/** check if a pde maps a 4MB page instead of a page table */
+static inline int is_large_pde(pde_t pde) {
+    return ((pde & (PDE_PS << PDE_PS_SHIFT)) != 0);
+}
+
+/** get address of the 4MB page from a pde */
+static inline pa_t get_large_page_base(pde_t pde) {
+    return (pa_t)(pde & (~(PT_SIZE - 1)));
+}
+
 /** get index in page directory of an address */
 static inline int get_pd_index(va_t va) {
     return va / PAGE_SIZE / NUM_PAGE_ENTRY;
@@ -138,11 +172,35 @@ static inline int get_pt_index(va_t va) {
     return (va / PAGE_SIZE) % NUM_PAGE_ENTRY;
 }
 
+/** page directory slot pointing to the page directory itself, so the page
+ * tables of current address space are always mapped */
+#define SELF_PD_INDEX (NUM_PAGE_ENTRY - 1)
+
+/** where page tables of current address space are mapped */
+#define SELF_PT_BASE ((va_t)(SELF_PD_INDEX * PT_SIZE))
+
+/** where page directory of current address space is mapped */
+#define SELF_PD_BASE (SELF_PT_BASE + SELF_PD_INDEX * PAGE_SIZE)
+
+/** user memory ends where page tables are mapped */
+#define USER_MEM_END SELF_PT_BASE
+
+/** get page directory of current address space through the self mapping */
+static inline page_directory_t* self_pd() {
+    return (page_directory_t*)SELF_PD_BASE;
+}
+
+/** get page table of an address in current address space through the self
+ * mapping, the page directory entry must be present */
+static inline page_table_t* self_pt(va_t va) {
+    return (page_table_t*)(SELF_PT_BASE + get_pd_index(va) * PAGE_SIZE);
+}
+
 /** kernel's page directory which directly maps all kernel memory */
 extern page_directory_t* kernel_pd;
-/** area for mapping physical pages */
+/** area for mapping physical pages, each CPU has KMAP_SLOTS pages */
 extern va_t mapped_phys_pages;
-/** location of the page table entry of the mapping area */
+/** location of the page table entries of the mapping area */
 extern pte_t* mapped_phys_page_ptes;
 
 /**
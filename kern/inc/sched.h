@@ -12,17 +12,19 @@
 #include <common_kern.h>
 #include <elf/elf_410.h>
 
+#include <x86/cr.h>
 #include <x86/eflags.h>
 #include <x86/seg.h>
 
 #include <common.h>
+#include <loader.h>
+#include <mm.h>
 #include <pts.h>
 #include <paging.h>
 #include <pv.h>
+#include <smp.h>
 #include <sync.h>
 
-/** name of idle process */
-#define IDLE_NAME "idle"
 /** name of init process */
 #define INIT_NAME "init"
 
@@ -57,10 +59,16 @@
 
 /** an allocated memory of a process */
 typedef struct region_s {
+    rb_t node; /* node in process' region tree, keyed by page number of addr */
     va_t addr;
     va_size_t size; /* size in bytes */
-    pa_t paddr;
     int is_rw;
+    int is_huge;     /* 4MB aligned blocks are backed by huge pages */
+    va_t base;       /* address the region was created at, a grow-down
+                        region keeps it while addr moves down */
+    va_t grow_limit; /* lowest address a grow-down region grows to, 0 if the
+                        region never grows */
+    file_map_t file; /* pages with file content are read in on first touch */
 } region_t;
 
 /**
@@ -124,14 +132,15 @@ typedef struct process_s {
     cv_t wait_cv;
 
     pa_t cr3;
-    vector_t regions; /* record the vitural memories the user has mapped */
+    rb_t* regions;    /* record the vitural memories the user has mapped */
     mutex_t mm_lock;  /* lock when operating VM */
 
     pv_t* pv;
 } process_t;
 
-/** status of the thread, must lock ready_lock to change it, otherwise may be
- * changed back to READY by timer interrupt */
+/** status of the thread, must lock the run queue of the thread's CPU to change
+ * it to or from READY, otherwise may be changed back to READY by timer
+ * interrupt */
 typedef enum thr_stat_e {
     THREAD_RUNNING,
     THREAD_READY,
@@ -147,6 +156,10 @@ typedef struct thread_s {
     thr_stat_t status;
     spl_t status_lock;
     queue_t sched_link; /* in ready queue or other queue */
+    int cpu;            /* CPU whose run queue the thread is in or joins next */
+    int affinity;       /* mask of CPUs the thread is allowed to run on */
+    queue_t timer_link; /* in a timer wheel slot when sleeping */
+    uint32_t wakeup;    /* tick to wake up at when sleeping */
     int pending_exit;   /* if a task_vanish is pending */
 
     queue_t process_link; /* in process_t's threads queue */
@@ -176,11 +189,14 @@ int alloc_tid();
 /** initial stack size for user program, 16 pages is a middle size that do not
  * waste too much and big enough for arguments  */
 #define DEFAULT_STACK_SIZE (65536)
-/** initial stack end for user program, skip the last page as it would cause
- * round bugs */
-#define DEFAULT_STACK_END (0xffffe000)
+/** initial stack end for user program, skip the last page below page table
+ * mapping as it would cause round bugs */
+#define DEFAULT_STACK_END (USER_MEM_END - PAGE_SIZE)
 /** inital stack area start */
 #define DEFAULT_STACK_POS (DEFAULT_STACK_END - DEFAULT_STACK_SIZE)
+/** number of pages a stack region grows by at a time, aligned so a fault
+ * never grows it across a page table */
+#define STACK_GROW_PAGES 16
 
 /** maximum arg length for exec(), a middle size */
 #define MAX_ARG_LEN 4096
@@ -217,15 +233,115 @@ void destroy_thread(thread_t* t);
 void destroy_pd(pa_t pd_pa);
 
 /**
- * @brief add a memory region to a process
+ * @brief add a memory region to a process, pages are allocated on first touch
  * @param p the process
  * @param addr virtual address
  * @param n_pages number of pages in this region
- * @param pa physical address
  * @param is_rw is this region writeable
  * @return 0 for success, -1 for failure
  */
-int add_region(process_t* p, va_t vaddr, int n_pages, pa_t pa, int is_rw);
+int add_region(process_t* p, va_t vaddr, int n_pages, int is_rw);
+
+/**
+ * @brief add a memory region backed by file content to a process, pages are
+ * filled from file on first touch
+ * @param p the process
+ * @param addr virtual address
+ * @param n_pages number of pages in this region
+ * @param is_rw is this region writeable
+ * @param file file content of the region, NULL for anonymous memory
+ * @return 0 for success, -1 for failure
+ */
+int add_file_region(process_t* p,
+                    va_t vaddr,
+                    int n_pages,
+                    int is_rw,
+                    const file_map_t* file);
+
+/**
+ * @brief find the region containing an address
+ * @param p the process
+ * @param addr virtual address
+ * @return the region or NULL if addr is not in any region
+ */
+region_t* find_region(process_t* p, va_t vaddr);
+
+/**
+ * @brief grow the grow-down region above an address down to cover it, the
+ * region grows by STACK_GROW_PAGES aligned pages without passing its limit or
+ * the region below, p->mm_lock must be held
+ * @param p the process
+ * @param vaddr virtual address not in any region
+ * @return the grown region or NULL if no region can grow to vaddr
+ */
+region_t* grow_region(process_t* p, va_t vaddr);
+
+/**
+ * @brief unmap a region's pages and drop their references
+ * @param p the process
+ * @param cr3 page directory the region is mapped in
+ * @param r the region
+ */
+void release_region(process_t* p, pa_t cr3, region_t* r);
+
+/**
+ * @brief release a region and remove it from a process
+ * @param p the process
+ * @param cr3 page directory the region is mapped in
+ * @param r the region
+ */
+void remove_region(process_t* p, pa_t cr3, region_t* r);
+
+/**
+ * @brief release and remove all regions of a process
+ * @param p the process
+ * @param cr3 page directory the regions are mapped in
+ */
+void remove_all_regions(process_t* p, pa_t cr3);
+
+/**
+ * @brief check if a page directory of p is in use, so its page tables can be
+ * reached through the self mapping
+ * @param p the process, PV guests' page directories have no self mapping
+ * @param cr3 the page directory
+ * @return nonzero if the page directory is in use
+ */
+static inline int is_current_pd(process_t* p, pa_t cr3) {
+    return (p->pv == NULL && cr3 == (pa_t)get_cr3());
+}
+
+/**
+ * @brief get a pointer to a page directory of p, the page directory in use is
+ * reached through the self mapping, others are mapped into the per-CPU window
+ * and interrupts must stay disabled while the pointer is used
+ * @param p the process
+ * @param cr3 the page directory
+ * @return pointer to the page directory
+ */
+static inline page_directory_t* map_user_pd(process_t* p, pa_t cr3) {
+    if (is_current_pd(p, cr3)) {
+        return self_pd();
+    }
+    return (page_directory_t*)map_phys_page(cr3);
+}
+
+/**
+ * @brief get a pointer to a page table of p, same rules as map_user_pd()
+ * @param p the process
+ * @param cr3 the page directory containing the page table
+ * @param vaddr any virtual address covered by the page table
+ * @param pt_pa physical address of the page table
+ * @return pointer to the page table
+ */
+static inline page_table_t* map_user_pt(process_t* p,
+                                        pa_t cr3,
+                                        va_t vaddr,
+                                        pa_t pt_pa) {
+    if (is_current_pd(p, cr3)) {
+        return self_pt(vaddr);
+    }
+    return (page_table_t*)map_phys_page(pt_pa);
+}
 
 /**
  * @brief find the page table for addr, or allocate one if not present
@@ -235,6 +351,51 @@ int add_region(process_t* p, va_t vaddr, int n_pages, pa_t pa, int is_rw);
  */
 pa_t find_or_create_pt(process_t* p, va_t vaddr);
 
+/**
+ * @brief map physically contiguous pages to a range of a process' address
+ * space, page tables will be created if not present, parts covering a whole
+ * page table with 4MB aligned physical address are mapped by 4MB pages
+ * @param p the process
+ * @param vaddr page aligned virtual address
+ * @param pa physical address of the first page
+ * @param n_pages number of pages
+ * @param is_rw are the pages writeable
+ * @return 0 for success, -1 for failure, pages mapped so far are kept
+ */
+int map_user_range(process_t* p, va_t vaddr, pa_t pa, int n_pages, int is_rw);
+
+/**
+ * @brief unmap a range of a page directory and drop one reference of each
+ * mapped page or huge page, a page is released only after its TLB entry is
+ * flushed
+ * @param p the process
+ * @param cr3 page directory the range is mapped in
+ * @param vaddr page aligned virtual address
+ * @param n_pages number of pages
+ */
+void unmap_user_range(process_t* p, pa_t cr3, va_t vaddr, int n_pages);
+
+/**
+ * @brief write protect the writeable pages of a range, they will be copied on
+ * next write
+ * @param p the process
+ * @param vaddr page aligned virtual address
+ * @param n_pages number of pages
+ */
+void protect_user_range(process_t* p, va_t vaddr, int n_pages);
+
+/**
+ * @brief copy page table entries of a range to another process and take one
+ * reference of each mapped page, writeable pages should be write protected
+ * first so both processes copy them on write
+ * @param dst destination process
+ * @param src source process
+ * @param vaddr page aligned virtual address
+ * @param n_pages number of pages
+ * @return 0 for success, -1 for failure, entries copied so far are kept
+ */
+int copy_user_range(process_t* dst, process_t* src, va_t vaddr, int n_pages);
+
 /**
  * @brief set fs
  * @param fs fs
@@ -247,17 +408,37 @@ void set_fs(reg_t fs);
  */
 void set_gs(reg_t gs);
 
+/** threads ready to run on a CPU */
+typedef struct run_queue_s {
+    spl_t lock;
+    queue_t* ready;     /* queue of ready threads */
+    int n_ready;        /* number of threads in ready */
+    int same_as_streak; /* times in a row the head of ready was passed over */
+    volatile int idle;  /* CPU is running its idle thread */
+    int steal_missed;   /* last steal skipped a busy run queue */
+} run_queue_t;
+
+/** IDT entry of the IPI asking an idle CPU to pick up a ready thread */
+#define RESCHED_IDT_ENTRY 0xF1
+
 /** CPU specific varibles */
 typedef struct percpu_s {
     thread_t* current;           /* current running thread */
     thread_t* idle;              /* idle thread */
     thread_t* kthread;           /* original kernel thread */
-    va_t mapped_phys_page;       /* physical page mapping area */
-    pte_t* mapped_phys_page_pte; /* pte for the mapping area */
+    va_t mapped_phys_page;       /* physical page mapping slots */
+    pte_t* mapped_phys_page_pte; /* ptes for the mapping slots */
+    struct percpu_s* percpu;     /* address of this structure */
+    page_cache_t page_cache;     /* free single pages owned by this CPU */
+    kmap_t kmap;                 /* state of the mapping slots */
+    run_queue_t rq;              /* threads ready to run on this CPU */
+    int cr3_reloads;             /* context switches that reloaded cr3 */
+    int cr3_reloads_skipped;     /* context switches that kept cr3 */
 } percpu_t;
 
 /**
- * @brief initialize fs segment's base to percpu structure
+ * @brief initialize fs segment's base to percpu structure and register its run
+ * queue for current CPU
  * @param percpu address of percpu structure
  */
 void setup_percpu(percpu_t* percpu);
@@ -321,6 +502,17 @@ pte_t* get_mapped_phys_page_pte();
  */
 void set_mapped_phys_page_pte(pte_t* pte);
 
+/**
+ * @brief get current CPU's percpu structure
+ * @return percpu structure
+ */
+percpu_t* get_percpu();
+/**
+ * @brief set current CPU's percpu structure
+ * @param percpu percpu structure
+ */
+void set_percpu(percpu_t* percpu);
+
 /**
  * @brief swap current thread's process and newt's process, newt must be a new
  * thread with new process, current thread must be the only thread in a process
@@ -331,10 +523,27 @@ void swap_process_inplace(thread_t* newt);
 /** init process */
 extern process_t* init_process;
 
-/** lock for ready queue */
-extern spl_t ready_lock;
-/** queue of ready threads */
-extern queue_t* ready;
+/** affinity mask allowing every CPU */
+#define ALL_CPUS ((1 << MAX_CPUS) - 1)
+
+/** mask of CPUs kept from the general pool, only threads whose affinity
+ * contains nothing but reserved CPUs run on them */
+extern int reserved_cpus;
+
+/** number of ready threads select_next() checks for one sharing the address
+ * space of current thread */
+#define SAME_AS_WINDOW 4
+/** number of times in a row select_next() may pass over the head of a run
+ * queue, so threads of other address spaces are not starved */
+#define SAME_AS_MAX_STREAK 4
+
+/**
+ * @brief sum the cr3 statistics of all CPUs
+ * @param reloads receives the number of cr3 reloads on context switches
+ * @param skipped receives the number of context switches that kept cr3 and
+ * the TLB entries
+ */
+void get_cr3_stats(int* reloads, int* skipped);
 
 /** rbtree of all threads */
 extern rb_t* threads;
@@ -342,28 +551,82 @@ extern rb_t* threads;
 extern mutex_t threads_lock;
 
 /**
- * @brief insert a thread to the tail of ready queue, must lock ready_lock
- * before calling this function
+ * @brief insert a thread which is in no queue to the tail of the run queue of
+ * its CPU
  * @param t thread to insert
  */
 void insert_ready_tail(thread_t* t);
 
 /**
- * @brief insert a thread to the head of ready queue, must lock ready_lock
- * before calling this function
+ * @brief insert a thread which is in no queue to the head of the run queue of
+ * its CPU
  * @param t thread to insert
  */
 void insert_ready_head(thread_t* t);
 
 /**
- * @brief select next ready thread
- * @return the thread
+ * @brief select next thread to run on current CPU, a thread near the head of
+ * the run queue sharing the address space of current thread is preferred, a
+ * thread is stolen from the busiest CPU if the run queue is empty, interrupts
+ * must be disabled
+ * @return the thread, which is marked running, or idle thread if there is none
  */
 thread_t* select_next();
 
 /**
- * @brief save current esp, load t's cr3, esp0 and return t's esp, must disable
- * interrupt before calling
+ * @brief take a thread out of the run queue it is in, so it can be yielded to
+ * @param t the thread
+ * @return status of t, t is taken and marked running only if it was ready
+ */
+thr_stat_t take_ready(thread_t* t);
+
+/**
+ * @brief insert current thread to the tail of current CPU's run queue and
+ * yield to a thread, current thread moves to the run queue of another CPU if
+ * it is no longer allowed to run on current CPU
+ * @param t thread taken by take_ready(), or NULL to run the next thread of
+ * current CPU
+ */
+void yield_current(thread_t* t);
+
+/**
+ * @brief handle a reschedule IPI, an idle CPU runs the thread that was made
+ * ready for it
+ */
+void resched_handler_real();
+
+/**
+ * @brief check if a thread may run on a CPU, which must be in its affinity
+ * and not reserved unless the affinity only has reserved CPUs
+ * @param t the thread
+ * @param cpu the CPU
+ * @return 1 if t may run on cpu, 0 otherwise
+ */
+int cpu_allowed(thread_t* t, int cpu);
+
+/**
+ * @brief set the affinity of a thread, a ready thread is moved to a run queue
+ * it is allowed to use, a running thread moves on its next yield, must hold
+ * threads_lock or be current thread so t is not freed
+ * @param t the thread
+ * @param mask mask of CPUs
+ * @return 0 on success, -1 if mask has no online CPU
+ */
+int set_affinity(thread_t* t, int mask);
+
+/**
+ * @brief reserve CPUs so only threads pinned to them run there, threads of the
+ * general pool already queued on them move to other CPUs
+ * @param mask mask of CPUs to reserve, replaces the old one
+ * @return 0 on success, -1 if no online CPU would be left for the general
+ * pool
+ */
+int reserve_cpus(int mask);
+
+/**
+ * @brief save current esp, load t's cr3, esp0 and return t's esp, cr3 is not
+ * reloaded if t runs in the loaded address space, must disable interrupt
+ * before calling
  * @param t thread to load
  * @param esp current esp
  * @return new esp
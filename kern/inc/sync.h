@@ -40,12 +40,25 @@ typedef struct spl_s {
  * @return original eflags
  */
 int spl_lock(spl_t* spl);
+/**
+ * @brief try to lock the spinlock once, interrupts are not changed
+ * @return 1 if the spinlock is locked, 0 if it is held by others
+ */
+int spl_trylock(spl_t* spl);
 /**
  * @brief unlock the spinlock and restore eflags
  * @param old_if eflags
  */
 void spl_unlock(spl_t* spl, int old_if);
 
+/**
+ * @brief atomically add a value to an integer
+ * @param p the integer
+ * @param val value to add
+ * @return the new value
+ */
+int atomic_add(int* p, int val);
+
 /**
  * @brief atomically yield to another thread and unlock the spinlock, eflags
  * will be restored when current thread become running again
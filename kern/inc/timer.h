@@ -9,12 +9,56 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
-/** ticks passed */
-extern unsigned int ticks;
-/** timer heap lock */
-extern spl_t timer_lock;
-/** timers of sleeping threads */
-extern heap_t timers;
+#include <common.h>
+#include <sync.h>
+
+/** program the LAPIC timer in one-shot mode for the next event only, instead
+ * of ticking periodically, idle CPUs stop ticking when nothing sleeps */
+#define TIMER_TICKLESS 1
+
+/** number of ticks a thread runs before it is preempted */
+#define TIMER_QUANTUM 1
+
+/** log2 of slots in one level of a timer wheel */
+#define WHEEL_BITS 6
+/** slots in one level of a timer wheel */
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+/** levels of a timer wheel, level l slots span WHEEL_SIZE^l ticks, timers
+ * further than WHEEL_SIZE^WHEEL_LEVELS ticks away are parked in the last
+ * slot they reach and placed again when it cascades */
+#define WHEEL_LEVELS 4
+
+/** sleeping threads of a CPU, hashed by wakeup tick into slots, a slot of an
+ * upper level is spread into lower levels (cascaded) when the clock reaches
+ * it */
+typedef struct timer_wheel_s {
+    spl_t lock;
+    unsigned int now;           /* next tick to process */
+    volatile unsigned int next; /* no timer needs processing before it */
+    int count;                  /* number of timers in the wheel */
+    queue_t* slots[WHEEL_LEVELS][WHEEL_SIZE];
+} timer_wheel_t;
+
+/**
+ * @brief get ticks passed since boot, which are counted by TSC so they are
+ * the same on all CPUs whether or not they tick
+ * @return the ticks
+ */
+unsigned int timer_ticks();
+
+/**
+ * @brief put current thread to sleep in current CPU's timer wheel
+ * @param wakeup the tick to wake up at
+ */
+void sleep_until(unsigned int wakeup);
+
+/**
+ * @brief program the LAPIC timer of current CPU for the earlier of the next
+ * timer and the end of current quantum, or only for the next timer if the CPU
+ * is idle, does nothing if the timer is periodic, interrupts must be disabled
+ * @param is_idle is current CPU going to run its idle thread
+ */
+void timer_rearm(int is_idle);
 
 /**
  * @brief initialize the timer
@@ -0,0 +1,117 @@
+/** @file tlb.h
+ *
+ *  @brief TLB management across CPUs.
+ *
+ *  @author Hanjie Wu (hanjiew)
+ *  @bug No functional bugs
+ */
+
+#ifndef _TLB_H_
+#define _TLB_H_
+
+#include <paging.h>
+
+/** IDT entry of TLB shootdown IPI */
+#define TLB_SHOOTDOWN_IDT_ENTRY 0xF0
+
+/** flushing more pages than this reloads cr3 instead of flushing TLB page by
+ * page */
+#define TLB_FLUSH_THRESHOLD 16
+
+/** number of pages in a flush that reloads cr3 */
+#define TLB_FLUSH_ALL (-1)
+
+/** number of pages a TLB batch can release at a time */
+#define TLB_BATCH_PAGES 64
+
+/** number of detached page tables a TLB batch can release at a time, each
+ * covers a whole page table range of pages */
+#define TLB_BATCH_TABLES 32
+
+/** invalidations of a page directory collected by one operation, pages
+ * unmapped by the operation are released only after the TLB entries of all
+ * CPUs are flushed */
+typedef struct tlb_batch_s {
+    pa_t cr3;
+    va_t start;    /* first page to invalidate */
+    va_t end;      /* end of pages to invalidate, equals start if none */
+    int flush_all; /* paging structures are removed, flush everything */
+    int count;
+    pa_t pages[TLB_BATCH_PAGES]; /* pages to release after flush */
+    int n_tables;
+    pa_t tables[TLB_BATCH_TABLES]; /* page tables to release with their
+                                    * pages after flush */
+} tlb_batch_t;
+
+/**
+ * @brief load a page directory on current CPU and record it, so current CPU
+ * gets TLB shootdowns of the page directory
+ * @param cr3 the page directory
+ */
+void load_cr3(pa_t cr3);
+
+/**
+ * @brief flush TLB entries of a range on all CPUs which have loaded the page
+ * directory, other CPUs are notified by one IPI and waited for, must not be
+ * called while holding a spinlock
+ * @param cr3 the page directory
+ * @param vaddr page aligned virtual address
+ * @param n_pages number of pages, or TLB_FLUSH_ALL
+ */
+void tlb_shootdown(pa_t cr3, va_t vaddr, int n_pages);
+
+/**
+ * @brief start collecting invalidations of a page directory
+ * @param b the batch
+ * @param cr3 the page directory
+ */
+void tlb_batch_init(tlb_batch_t* b, pa_t cr3);
+
+/**
+ * @brief check if a batch can not take more pages
+ * @param b the batch
+ * @return 1 if the batch is full, 0 otherwise
+ */
+static inline int tlb_batch_full(tlb_batch_t* b) {
+    return (b->count == TLB_BATCH_PAGES);
+}
+
+/**
+ * @brief add an unmapped page to a batch, a full batch is flushed first
+ * @param b the batch
+ * @param vaddr virtual address the page was mapped at
+ * @param pa the page, whose reference is dropped after flush
+ */
+void tlb_batch_add(tlb_batch_t* b, va_t vaddr, pa_t pa);
+
+/**
+ * @brief add a page table or huge page removed from the page directory to a
+ * batch, which makes the flush reload cr3, a full batch is flushed first
+ * @param b the batch
+ * @param pa the page table or huge page, whose reference is dropped after
+ * flush
+ */
+void tlb_batch_add_pde(tlb_batch_t* b, pa_t pa);
+
+/**
+ * @brief add a page table detached from the page directory with its entries
+ * intact to a batch, which makes the flush reload cr3, a full batch is flushed
+ * first
+ * @param b the batch
+ * @param pa the page table, whose pages and itself are released after flush
+ */
+void tlb_batch_add_pt(tlb_batch_t* b, pa_t pa);
+
+/**
+ * @brief flush TLB entries collected by a batch on all CPUs and release its
+ * pages, the batch can be reused afterwards
+ * @param b the batch
+ */
+void tlb_batch_flush(tlb_batch_t* b);
+
+/**
+ * @brief handle a TLB shootdown IPI
+ */
+void tlb_shootdown_handler_real();
+
+#endif
@@ -29,6 +29,7 @@
 #include <sched.h>
 #include <sync.h>
 #include <timer.h>
+#include <tlb.h>
 #include <usermem.h>
 
 /**
@@ -125,6 +126,14 @@ void timer_handler();
  * @brief keyboard handler entry
  */
 void kbd_handler();
+/**
+ * @brief TLB shootdown IPI handler entry
+ */
+void tlb_shootdown_handler();
+/**
+ * @brief reschedule IPI entry
+ */
+void resched_handler();
 
 /**
  * @brief fork() syscall entry
@@ -162,6 +171,34 @@ void sys_new_pages();
  * @brief remove_pages() syscall entry
  */
 void sys_remove_pages();
+/**
+ * @brief new_pages_populate() syscall entry
+ */
+void sys_new_pages_populate();
+/**
+ * @brief new_pages_huge() syscall entry
+ */
+void sys_new_pages_huge();
+/**
+ * @brief set_affinity() syscall entry
+ */
+void sys_set_affinity();
+/**
+ * @brief get_affinity() syscall entry
+ */
+void sys_get_affinity();
+/**
+ * @brief reserve_cpus() syscall entry
+ */
+void sys_reserve_cpus();
+/**
+ * @brief get_cr3_stats() syscall entry
+ */
+void sys_get_cr3_stats();
+/**
+ * @brief new_pages_growdown() syscall entry
+ */
+void sys_new_pages_growdown();
 /**
  * @brief sleep() syscall entry
  */
@@ -311,34 +348,6 @@ void sys_114();
  * @brief syscall 115 entry
  */
 void sys_115();
-/**
- * @brief syscall 128 entry
- */
-void sys_128();
-/**
- * @brief syscall 129 entry
- */
-void sys_129();
-/**
- * @brief syscall 130 entry
- */
-void sys_130();
-/**
- * @brief syscall 131 entry
- */
-void sys_131();
-/**
- * @brief syscall 132 entry
- */
-void sys_132();
-/**
- * @brief syscall 133 entry
- */
-void sys_133();
-/**
- * @brief syscall 134 entry
- */
-void sys_134();
 
 /**
  * @brief all other syscall entries
@@ -454,15 +463,27 @@ void idt_init() {
     idt[115] = make_idt((va_t)sys_115, IDT_TYPE_T32, IDT_DPL_USER);
     idt[SWEXN_INT] = make_idt((va_t)sys_swexn, IDT_TYPE_T32, IDT_DPL_USER);
 
-    idt[128] = make_idt((va_t)sys_128, IDT_TYPE_T32, IDT_DPL_USER);
-    idt[129] = make_idt((va_t)sys_129, IDT_TYPE_T32, IDT_DPL_USER);
-    idt[130] = make_idt((va_t)sys_130, IDT_TYPE_T32, IDT_DPL_USER);
-    idt[131] = make_idt((va_t)sys_131, IDT_TYPE_T32, IDT_DPL_USER);
-    idt[132] = make_idt((va_t)sys_132, IDT_TYPE_T32, IDT_DPL_USER);
-    idt[133] = make_idt((va_t)sys_133, IDT_TYPE_T32, IDT_DPL_USER);
-    idt[134] = make_idt((va_t)sys_134, IDT_TYPE_T32, IDT_DPL_USER);
+    idt[NEW_PAGES_POPULATE_INT] =
+        make_idt((va_t)sys_new_pages_populate, IDT_TYPE_T32, IDT_DPL_USER);
+    idt[NEW_PAGES_HUGE_INT] =
+        make_idt((va_t)sys_new_pages_huge, IDT_TYPE_T32, IDT_DPL_USER);
+    idt[SET_AFFINITY_INT] =
+        make_idt((va_t)sys_set_affinity, IDT_TYPE_T32, IDT_DPL_USER);
+    idt[GET_AFFINITY_INT] =
+        make_idt((va_t)sys_get_affinity, IDT_TYPE_T32, IDT_DPL_USER);
+    idt[RESERVE_CPUS_INT] =
+        make_idt((va_t)sys_reserve_cpus, IDT_TYPE_T32, IDT_DPL_USER);
+    idt[GET_CR3_STATS_INT] =
+        make_idt((va_t)sys_get_cr3_stats, IDT_TYPE_T32, IDT_DPL_USER);
+    idt[NEW_PAGES_GROWDOWN_INT] =
+        make_idt((va_t)sys_new_pages_growdown, IDT_TYPE_T32, IDT_DPL_USER);
 
     idt[HV_INT] = make_idt((va_t)sys_hvcall, IDT_TYPE_T32, IDT_DPL_USER);
+
+    idt[TLB_SHOOTDOWN_IDT_ENTRY] = make_idt((va_t)tlb_shootdown_handler,
+                                            IDT_TYPE_I32, IDT_DPL_KERNEL);
+    idt[RESCHED_IDT_ENTRY] =
+        make_idt((va_t)resched_handler, IDT_TYPE_I32, IDT_DPL_KERNEL);
 }
 
 /** string explanation of fault */
@@ -532,31 +553,284 @@ void handle_fault(ureg_t* frame) {
 }
 
 /**
- * @brief handle a ZFOD caused fault
+ * @brief read the page table entry of a user address, faults always happen in
+ * current address space so page tables are reached through the self mapping
+ * @param va virtual address
+ * @return the page table entry, BAD_PTE if there is no page table
+ */
+static pte_t get_user_pte(va_t va) {
+    if ((*self_pd())[get_pd_index(va)] == BAD_PDE) {
+        return BAD_PTE;
+    }
+    return (*self_pt(va))[get_pt_index(va)];
+}
+
+/**
+ * @brief update the page table entry of a user address in current address
+ * space, the page table must exist
+ * @param va virtual address
+ * @param pte new page table entry
+ */
+static void set_user_pte(va_t va, pte_t pte) {
+    (*self_pt(va))[get_pt_index(va)] = pte;
+    /* other threads of the process may cache the old entry */
+    tlb_shootdown((pa_t)get_cr3(), va, 1);
+}
+
+/**
+ * @brief update the page directory entry of a user address in current address
+ * space
+ * @param va virtual address
+ * @param pde new page directory entry
+ */
+static void set_user_pde(va_t va, pde_t pde) {
+    (*self_pd())[get_pd_index(va)] = pde;
+    /* the self mapping of the slot may alias the old huge page */
+    tlb_shootdown((pa_t)get_cr3(), va, TLB_FLUSH_ALL);
+}
+
+/**
+ * @brief copy a user page's content to a physical page
+ * @param pa physical address of the page
+ * @param src user address of content
+ */
+static void copy_user_page(pa_t pa, va_t src) {
+    int old_if = save_clear_if();
+    char* page = (char*)kmap(pa);
+    memcpy(page, (char*)src, PAGE_SIZE);
+    kunmap((va_t)page);
+    restore_if(old_if);
+}
+
+/**
+ * @brief get the backing page of a page with file content
+ * @param r region containing the page
+ * @param va page aligned virtual address
+ * @return physical address of the page, BAD_PA on failure
+ */
+static pa_t populate_file_page(region_t* r, va_t va) {
+    if (r->is_rw == 0) {
+        /* read only content is the same in every process */
+        return get_shared_file_page(&r->file, va);
+    }
+    pa_t pa = alloc_zeroed_user_page();
+    if (pa != BAD_PA) {
+        read_file_page(&r->file, va, pa);
+    }
+    return pa;
+}
+
+/**
+ * @brief populate the untouched pages in an aligned window around a ZFOD fault,
+ * pages with file content are read from file, other reads map the zero page
+ * and writes allocate zeroed pages
+ * @param p process
+ * @param r region containing the fault address
+ * @param va page of the fault address
+ * @param is_write is the fault caused by a write
+ * @return 0 on success, -1 if the faulting page cannot be populated
+ */
+static int fault_around(process_t* p, region_t* r, va_t va, int is_write) {
+    /* an aligned window never crosses a page table */
+    va_t start = (va & (~(FAULT_AROUND_PAGES * PAGE_SIZE - 1)));
+    va_t end = start + FAULT_AROUND_PAGES * PAGE_SIZE;
+    if (start < r->addr) {
+        start = r->addr;
+    }
+    /* window may wrap around at the top of memory */
+    if (end < start || end > r->addr + r->size) {
+        end = r->addr + r->size;
+    }
+    int i, n = (end - start) / PAGE_SIZE;
+    int first = get_pt_index(start);
+    pa_t pt_pa = find_or_create_pt(p, va);
+    if (pt_pa == BAD_PA) {
+        return -1;
+    }
+
+    pte_t ptes[FAULT_AROUND_PAGES];
+    page_table_t* pt = self_pt(va);
+    for (i = 0; i < n; i++) {
+        ptes[i] = (*pt)[first + i];
+    }
+
+    pte_t zero_pte = make_pte(zero_page, 0, PTE_USER, PTE_RO, PTE_PRESENT);
+    if (r->is_rw) {
+        zero_pte |= (PTE_COW << PTE_COW_SHIFT);
+    }
+    for (i = 0; i < n; i++) {
+        va_t page_va = start + i * PAGE_SIZE;
+        if (ptes[i] != BAD_PTE) {
+            /* already populated, leave it alone */
+            ptes[i] = BAD_PTE;
+            continue;
+        }
+        pa_t pa;
+        if (is_file_page(&r->file, page_va)) {
+            pa = populate_file_page(r, page_va);
+        } else if (is_write == 0) {
+            ptes[i] = zero_pte;
+            continue;
+        } else {
+            pa = alloc_zeroed_user_page();
+        }
+        if (pa == BAD_PA) {
+            if (page_va == va) {
+                goto alloc_fail;
+            }
+            /* neighbours are optional */
+            continue;
+        }
+        ptes[i] = make_pte(pa, 0, PTE_USER, (r->is_rw ? PTE_RW : PTE_RO),
+                           PTE_PRESENT);
+    }
+
+    /* entries were not present, so there is no stale TLB entry to flush */
+    int added = 0;
+    for (i = 0; i < n; i++) {
+        if (ptes[i] != BAD_PTE) {
+            (*pt)[first + i] = ptes[i];
+            added++;
+        }
+    }
+    adjust_pt_entries(pt_pa, added);
+    return 0;
+
+alloc_fail:
+    for (i--; i >= 0; i--) {
+        if (ptes[i] != BAD_PTE) {
+            put_user_page(get_page_base(ptes[i]));
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief back the 4MB block around a ZFOD fault by a zeroed huge page, the
+ * block must be inside a huge page region and have no page table yet
+ * @param r region containing the fault address
+ * @param va page of the fault address
+ * @return 0 on success, -1 if the fault should be handled by small pages
+ */
+static int fault_huge_page(region_t* r, va_t va) {
+    va_t start = (va & (~(PT_SIZE - 1)));
+    if (r->is_huge == 0 || r->size < PT_SIZE || start < r->addr ||
+        start - r->addr > r->size - PT_SIZE) {
+        return -1;
+    }
+    if ((*self_pd())[get_pd_index(va)] != BAD_PDE) {
+        /* small pages are already used in this block */
+        return -1;
+    }
+    pa_t pa = alloc_huge_user_page();
+    if (pa == BAD_PA) {
+        return -1;
+    }
+    zero_user_pages(pa, HUGE_PAGE_PAGES);
+    /* the entry was not present, so there is no stale TLB entry to flush */
+    (*self_pd())[get_pd_index(va)] = make_large_pde(
+        pa, 0, PTE_USER, (r->is_rw ? PTE_RW : PTE_RO), PTE_PRESENT);
+    return 0;
+}
+
+/**
+ * @brief handle a copy-on-write fault on a huge page, the huge page is copied
+ * as a whole
+ * @param frame ureg registers
+ * @param pde page directory entry of the fault address
+ * @return -1 if not a copy-on-write fault, 0 for success
+ */
+static int handle_huge_cow(ureg_t* frame, pde_t pde) {
+    if ((frame->error_code & PF_ERR_WRITE) == 0 ||
+        (pde & (PTE_COW << PTE_COW_SHIFT)) == 0) {
+        return -1;
+    }
+    va_t base = (frame->cr2 & (~(PT_SIZE - 1)));
+    pa_t pa = get_large_page_base(pde);
+    pde_t new_pde = ((pde & (~(PTE_COW << PTE_COW_SHIFT))) |
+                     (PTE_RW << PTE_RW_SHIFT));
+    if (get_user_page_refcount(pa) == 1) {
+        /* other sharers have gone, take over the page */
+        set_user_pde(base, new_pde);
+        return 0;
+    }
+    pa_t new_pa = alloc_huge_user_page();
+    if (new_pa == BAD_PA) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < HUGE_PAGE_PAGES; i++) {
+        copy_user_page(new_pa + i * PAGE_SIZE, base + i * PAGE_SIZE);
+    }
+    set_user_pde(base, ((new_pde & (PT_SIZE - 1)) | new_pa));
+    put_user_page(pa);
+    return 0;
+}
+
+/**
+ * @brief handle a ZFOD or copy-on-write caused fault, ZFOD pages have no
+ * page table entry until they are first touched
  * @param frame ureg registers
  * @param t current thread
- * @return -1 if not ZFOD fault, 0 for success
+ * @return -1 if not ZFOD or copy-on-write fault, 0 for success
  */
 static int handle_zfod(ureg_t* frame, thread_t* t) {
-    int result = -1;
     process_t* p = t->process;
-    int old_if = save_clear_if();
-    pa_t old_pa;
-    page_directory_t* pd = (page_directory_t*)map_phys_page(p->cr3, &old_pa);
-    pde_t* pde = &(*pd)[get_pd_index(frame->cr2)];
-    if (*pde != BAD_PDE) {
-        pa_t pt_pa = get_page_table(*pde);
-        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
-        pte_t* pte = &(*pt)[get_pt_index(frame->cr2)];
-        if (*pte != BAD_PTE && ((*pte & (PTE_PRESENT << PTE_P_SHIFT)) == 0)) {
-            *pte = (*pte | (PTE_PRESENT << PTE_P_SHIFT));
-            invlpg(frame->cr2);
-            memset((void*)(frame->cr2 & PAGE_BASE_MASK), 0, PAGE_SIZE);
-            result = 0;
+    /* PV guests' memory is always present and never shared */
+    if (p->pv != NULL) {
+        return -1;
+    }
+    int result = -1;
+    va_t va = (frame->cr2 & PAGE_BASE_MASK);
+    /* other threads may change the page table entry before we lock */
+    mutex_lock(&p->mm_lock);
+    pde_t pde = (*self_pd())[get_pd_index(va)];
+    if (is_large_pde(pde)) {
+        result = handle_huge_cow(frame, pde);
+        goto not_handled;
+    }
+    pte_t pte = get_user_pte(va);
+    pa_t pa = get_page_base(pte);
+    if (pte == BAD_PTE) {
+        /* allocate the backing page on first touch */
+        region_t* r = find_region(p, va);
+        if (r == NULL && (r = grow_region(p, va)) == NULL) {
+            goto not_handled;
+        }
+        /* small pages are used when no huge page is available */
+        if (fault_huge_page(r, va) != 0 &&
+            fault_around(p, r, va, (frame->error_code & PF_ERR_WRITE)) != 0) {
+            goto not_handled;
         }
+        result = 0;
+    } else if ((frame->error_code & PF_ERR_WRITE) != 0 &&
+               (pte & (PTE_COW << PTE_COW_SHIFT)) != 0) {
+        pte_t new_pte = ((pte & (~(PTE_COW << PTE_COW_SHIFT))) |
+                         (PTE_RW << PTE_RW_SHIFT));
+        if (pa == zero_page) {
+            /* no need to copy zeros */
+            pa_t new_pa = alloc_zeroed_user_page();
+            if (new_pa == BAD_PA) {
+                goto not_handled;
+            }
+            set_user_pte(va, ((new_pte & PAGE_OFFSET_MASK) | new_pa));
+        } else if (get_user_page_refcount(pa) == 1) {
+            /* other sharers have gone, take over the page */
+            set_user_pte(va, new_pte);
+        } else {
+            pa_t new_pa = alloc_user_pages(1);
+            if (new_pa == BAD_PA) {
+                goto not_handled;
+            }
+            copy_user_page(new_pa, va);
+            set_user_pte(va, ((new_pte & PAGE_OFFSET_MASK) | new_pa));
+            put_user_page(pa);
+        }
+        result = 0;
     }
-    map_phys_page(old_pa, NULL);
-    restore_if(old_if);
+
+not_handled:
+    mutex_unlock(&p->mm_lock);
     return result;
 }
 
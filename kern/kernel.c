@@ -22,6 +22,7 @@
 #include <x86/asm.h> /* enable_interrupts() */
 #include <x86/cr.h>
 
+#include <asm_instr.h>
 #include <assert.h>
 #include <common.h>
 #include <interrupt.h>
@@ -93,22 +94,49 @@ static void kernel_smp_entry(int cpuid) {
     thread_t kthread;
     process_t kprocess;
     setup_kth(&kthread, &kprocess);
-    set_mapped_phys_page(mapped_phys_pages + cpuid * PAGE_SIZE);
-    set_mapped_phys_page_pte(mapped_phys_page_ptes + cpuid);
+    set_mapped_phys_page(mapped_phys_pages + cpuid * KMAP_SLOTS * PAGE_SIZE);
+    set_mapped_phys_page_pte(mapped_phys_page_ptes + cpuid * KMAP_SLOTS);
     setup_lapic_timer();
     kernel_smp_main();
 }
 
 static void kernel_smp_main() {
-    const char* idle_args[] = {IDLE_NAME};
-    thread_t* idle = create_process(IDLE_PID, IDLE_NAME, 1, idle_args);
-    assert(idle != NULL);
-    set_idle(idle);
-
+    /* kthread is the idle thread, it halts in kernel until an interrupt
+     * brings work
+     */
+    set_idle(get_kthread());
+    get_percpu()->rq.idle = 1;
+
+    /* kthread is never in a run queue, so nobody else takes this lock */
+    spl_t kthread_lock = SPL_INIT;
     while (1) {
-        int old_if = spl_lock(&ready_lock);
+        int old_if = spl_lock(&kthread_lock);
         thread_t* t = select_next();
-        yield_to_spl_unlock(t, &ready_lock, old_if);
+        if (t == get_idle()) {
+            spl_unlock(&kthread_lock, old_if);
+            /* nothing to run, use the time to prepare zeroed pages */
+            if (refill_zeroed_pages() != 0) {
+                continue;
+            }
+            /* a thread that died on this CPU resumes kthread without going
+             * through save_and_setup_env, so mark the CPU idle again, a thread
+             * made ready from now on sends an IPI, which is taken right after
+             * sti and wakes hlt, and one made ready before is seen below, a
+             * run queue the last steal skipped as busy is tried again
+             */
+            disable_interrupts();
+            run_queue_t* rq = &get_percpu()->rq;
+            rq->idle = 1;
+            mfence();
+            if (rq->ready != NULL || rq->steal_missed) {
+                enable_interrupts();
+                continue;
+            }
+            timer_rearm(1);
+            sti_hlt();
+            continue;
+        }
+        yield_to_spl_unlock(t, &kthread_lock, old_if);
         /* when a thread borrow kthread's stack and free itself, it will return
          * here and we continue yielding
          */
@@ -18,6 +18,27 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <mm.h>
+#include <sync.h>
+
+/** @brief read only file content shared by processes running a file */
+typedef struct shared_segment_s {
+    /** where the content is mapped */
+    file_map_t fm;
+    /** next segment */
+    struct shared_segment_s* next;
+    /** frames holding the content, BAD_PA until first use, one reference of
+     * each loaded frame is held here
+     */
+    pa_t pages[];
+} shared_segment_t;
+
+/** known read only segments, there are at most 2 for each file in TOC */
+static shared_segment_t* shared_segments = NULL;
+
+/** lock for shared_segments */
+static mutex_t shared_segments_lock = MUTEX_INIT;
+
 /* --- Local function prototypes --- */
 
 /**
@@ -56,3 +77,70 @@ file_t* find_file(const char* name) {
     }
     return NULL;
 }
+
+void read_file_page(const file_map_t* fm, va_t va, pa_t pa) {
+    va_t f_end = fm->m_off + fm->f_len;
+    va_t start = (va < fm->m_off ? fm->m_off : va);
+    va_t end = (va + PAGE_SIZE < f_end ? va + PAGE_SIZE : f_end);
+    int old_if = save_clear_if();
+    char* page = (char*)kmap(pa);
+    read_file(fm->f, fm->f_off + (start - fm->m_off), end - start,
+              page + (start - va));
+    kunmap((va_t)page);
+    restore_if(old_if);
+}
+
+/**
+ * @brief find the shared segment of a file mapping, a new one is created if
+ * there is none, shared_segments_lock must be held
+ * @param fm file mapping
+ * @return the shared segment, NULL on failure
+ */
+static shared_segment_t* find_shared_segment(const file_map_t* fm) {
+    shared_segment_t* s;
+    for (s = shared_segments; s != NULL; s = s->next) {
+        if (s->fm.f == fm->f && s->fm.f_off == fm->f_off &&
+            s->fm.f_len == fm->f_len && s->fm.m_off == fm->m_off) {
+            return s;
+        }
+    }
+    va_t m_start = (fm->m_off & PAGE_BASE_MASK);
+    int n_pages =
+        ((fm->m_off + fm->f_len - m_start) + (PAGE_SIZE - 1)) / PAGE_SIZE;
+    s = malloc(sizeof(shared_segment_t) + n_pages * sizeof(pa_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->fm = *fm;
+    int i;
+    for (i = 0; i < n_pages; i++) {
+        s->pages[i] = BAD_PA;
+    }
+    s->next = shared_segments;
+    shared_segments = s;
+    return s;
+}
+
+pa_t get_shared_file_page(const file_map_t* fm, va_t va) {
+    pa_t pa = BAD_PA;
+    mutex_lock(&shared_segments_lock);
+    shared_segment_t* s = find_shared_segment(fm);
+    if (s == NULL) {
+        goto find_segment_fail;
+    }
+    pa_t* page = &s->pages[(va - (fm->m_off & PAGE_BASE_MASK)) / PAGE_SIZE];
+    if (*page == BAD_PA) {
+        /* bytes out of the content stay zero, like a private copy */
+        *page = alloc_zeroed_user_page();
+        if (*page == BAD_PA) {
+            goto find_segment_fail;
+        }
+        read_file_page(fm, va, *page);
+    }
+    pa = *page;
+    get_user_page(pa);
+
+find_segment_fail:
+    mutex_unlock(&shared_segments_lock);
+    return pa;
+}
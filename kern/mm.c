@@ -21,58 +21,60 @@
 #include <sched.h>
 #include <sync.h>
 
-/** header of a free page */
-typedef struct page_head_s {
-    int size;
-    pa_t prev;
-    pa_t next;
-} page_head_t;
-
-/** footer of a free page */
-typedef struct page_foot_s {
-    char padding[PAGE_SIZE - sizeof(int)];
-    int size;
-} page_foot_t;
+/** number of buddy orders, the largest block is 2^(NUM_ORDERS-1) pages */
+#define NUM_ORDERS 20
+/** order of a frame that is not the head of a free block */
+#define FRAME_NOT_FREE (-1)
+/** end of a free list */
+#define NO_FRAME (-1)
+
+/** frame flag, content of a free or never mapped frame is all zero */
+#define FRAME_ZEROED 1
+/** frame flag, the frame is the first one of an allocated huge page */
+#define FRAME_HUGE 2
+
+/** maximum number of pages in the pre-zeroed pool */
+#define ZERO_POOL_SIZE 1024
+/** number of pages an idle CPU zeroes at once */
+#define ZERO_BATCH 16
+/** number of free frames checked at once when looking for one to zero */
+#define SCRUB_SCAN_LIMIT 256
+
+/** descriptor of a user page frame, kept outside of the frame so managing
+ * free blocks never needs to map them */
+typedef struct frame_s {
+    int refcount; /* number of mappings referencing this frame */
+    int order;    /* order of the free block starting here, or FRAME_NOT_FREE */
+    int prev;     /* previous free block of the same order */
+    int next;     /* next free block of the same order, or in zero pool */
+    int flags;
+    int live;     /* number of present entries if this frame is a page table */
+} frame_t;
 
 /** total user pages */
 static int num_user_pages;
 
-/** bitmap to track page usage */
-static unsigned char* user_page_bitmap;
+/** descriptors of all user pages */
+static frame_t* frames;
 
-/** bins from 4k to 1m, which is normal request size */
-#define NUM_BINS 9
-/** minimum size of last bin */
-#define LAST_BIN_SIZE (1 << (NUM_BINS - 1))
-/** bins for free chunks */
-static pa_t bins[NUM_BINS];
+/** free lists of each order */
+static int free_lists[NUM_ORDERS];
 
-mutex_t mm_lock = MUTEX_INIT;
+spl_t mm_lock = SPL_INIT;
 
-/**
- * @brief is a page inuse
- * @param pn physical page number
- * @return 1 inuse, 0 free
- */
-static int is_page_inuse(int pn) {
-    return (user_page_bitmap[(pn + 1) / 8] & (1 << ((pn + 1) % 8))) != 0;
-}
+pa_t zero_page = BAD_PA;
 
-/**
- * @brief mark a page inuse
- * @param pn physical page number
- */
-static void set_page_inuse(int pn) {
-    user_page_bitmap[(pn + 1) / 8] |= (1 << ((pn + 1) % 8));
-}
+/** pre-zeroed pages taken out of buddy system, linked by frame_t.next */
+static int zero_pool = NO_FRAME;
+/** number of pages in zero_pool */
+static int zero_pool_count = 0;
+/** lock for zero_pool */
+static spl_t zero_lock = SPL_INIT;
 
-/**
- * @brief mark a page free
- * @param pn physical page number
- */
-static void set_page_free(int pn) {
-    user_page_bitmap[(pn + 1) / 8] &= (~(1 << ((pn + 1) % 8)));
-}
+/** next frame idle CPUs check for zeroing in place */
+static int scrub_cursor = 0;
+/** if there may be dirty frames in buddy system */
+static int scrub_pending = 1;
 
 /**
  * @brief convert physical address to page number
@@ -88,230 +90,590 @@ static int pa_to_pn(pa_t pa) {
  * @param pn physical page number
  * @return physical address
  */
-static int pn_to_pa(int pn) {
+static pa_t pn_to_pa(int pn) {
     return pn * PAGE_SIZE + USER_MEM_START;
 }
 
 /**
- * @brief find which bin a free chunk belongs to
- * @param size size of chunk
- * @return bin
+ * @brief add a free block to its free list
+ * @param pn first page of the block
+ * @param order order of the block
  */
-static int find_bin(int size) {
-    if (size >= LAST_BIN_SIZE) {
-        return NUM_BINS - 1;
+static void free_list_insert(int pn, int order) {
+    frame_t* f = &frames[pn];
+    f->order = order;
+    f->prev = NO_FRAME;
+    f->next = free_lists[order];
+    if (f->next != NO_FRAME) {
+        frames[f->next].prev = pn;
     }
-    int i;
-    for (i = NUM_BINS - 2; i > 0; i--) {
-        if ((size & (1 << i)) != 0) {
-            return i;
+    free_lists[order] = pn;
+}
+
+/**
+ * @brief remove a free block from its free list
+ * @param pn first page of the block
+ */
+static void free_list_delete(int pn) {
+    frame_t* f = &frames[pn];
+    if (f->prev != NO_FRAME) {
+        frames[f->prev].next = f->next;
+    } else {
+        free_lists[f->order] = f->next;
+    }
+    if (f->next != NO_FRAME) {
+        frames[f->next].prev = f->prev;
+    }
+    f->order = FRAME_NOT_FREE;
+}
+
+/**
+ * @brief free a block and merge it with its free buddies
+ * @param pn first page of the block, aligned to the block size
+ * @param order order of the block
+ */
+static void free_block(int pn, int order) {
+    while (order < NUM_ORDERS - 1) {
+        int buddy = (pn ^ (1 << order));
+        if (buddy + (1 << order) > num_user_pages ||
+            frames[buddy].order != order) {
+            break;
         }
+        free_list_delete(buddy);
+        pn = (pn & buddy);
+        order++;
     }
-    return 0;
+    free_list_insert(pn, order);
 }
 
 /**
- * @brief add a chunk to bins
- * @param pn physical page number
- * @param size size of chunk
+ * @brief free a range of pages by splitting it into aligned blocks
+ * @param pn first page of the range
+ * @param num_pages number of pages
  */
-static void add_to_bins(int pn, int size);
+static void free_range(int pn, int num_pages) {
+    while (num_pages > 0) {
+        int order = 0;
+        while (order < NUM_ORDERS - 1 && (pn & (1 << order)) == 0 &&
+               (2 << order) <= num_pages) {
+            order++;
+        }
+        free_block(pn, order);
+        pn += (1 << order);
+        num_pages -= (1 << order);
+    }
+}
 
 /**
- * @brief remove a chunk from bins
- * @param pn physical page number
+ * @brief fill a page with zeros
+ * @param pn the page
  */
-static void remove_from_bins(int pn);
+static void clear_page(int pn);
 
 /**
- * @brief allocate a memory from a bin
- * @param bin bin
- * @param size size of chunk
- * @return address of chunk, BAD_PA on failure
+ * @brief find a run of adjacent free blocks, this is slow and only used when
+ * no single block can satisfy a large request
+ * @param num_pages number of pages
+ * @return first page of the run, or NO_FRAME on failure
  */
-static pa_t alloc_from_bin(pa_t* bin, int size);
+static int alloc_unaligned(int num_pages) {
+    int pn = 0, start = 0, run = 0;
+    while (pn < num_user_pages) {
+        int order = frames[pn].order;
+        if (order == FRAME_NOT_FREE) {
+            /* page is in use, the run restarts from next page */
+            pn++;
+            start = pn;
+            run = 0;
+            continue;
+        }
+        pn += (1 << order);
+        run += (1 << order);
+        if (run >= num_pages) {
+            int i = start;
+            while (i < pn) {
+                int size = (1 << frames[i].order);
+                free_list_delete(i);
+                i += size;
+            }
+            free_range(start + num_pages, run - num_pages);
+            return start;
+        }
+    }
+    return NO_FRAME;
+}
 
 void mm_init() {
     num_user_pages = machine_phys_frames() - (USER_MEM_START / PAGE_SIZE);
     assert(num_user_pages > 0);
-    user_page_bitmap = smalloc((num_user_pages + 2) / 8);
-    assert(user_page_bitmap != NULL);
-    memset(user_page_bitmap, 0, (num_user_pages + 2) / 8);
-    memset(bins, 0, sizeof(bins));
+    frames = smalloc(num_user_pages * sizeof(frame_t));
+    assert(frames != NULL);
+    int i;
+    for (i = 0; i < num_user_pages; i++) {
+        frames[i].refcount = 0;
+        frames[i].order = FRAME_NOT_FREE;
+        frames[i].flags = 0;
+        frames[i].live = 0;
+    }
+    for (i = 0; i < NUM_ORDERS; i++) {
+        free_lists[i] = NO_FRAME;
+    }
+    free_range(0, num_user_pages);
 
-    set_page_inuse(-1);
-    set_page_inuse(num_user_pages);
-    add_to_bins(pa_to_pn(USER_MEM_START), num_user_pages);
+    zero_page = alloc_user_pages(1);
+    assert(zero_page != BAD_PA);
+    clear_page(pa_to_pn(zero_page));
 }
 
-pa_t alloc_user_pages(int num_pages) {
-    mutex_lock(&mm_lock);
-    int bn = find_bin(num_pages);
-    while (bn < NUM_BINS) {
-        pa_t result = alloc_from_bin(&bins[bn], num_pages);
-        if (result != BAD_PA) {
-            mutex_unlock(&mm_lock);
-            return result;
-        }
-        bn++;
+/**
+ * @brief allocate a block aligned to its size from buddy system, must lock
+ * mm_lock before calling
+ * @param order order of the block
+ * @return first page of the block, or NO_FRAME on failure
+ */
+static int alloc_order(int order) {
+    int k = order;
+    while (k < NUM_ORDERS && free_lists[k] == NO_FRAME) {
+        k++;
+    }
+    if (k == NUM_ORDERS) {
+        return NO_FRAME;
+    }
+    int pn = free_lists[k];
+    free_list_delete(pn);
+    /* split and give back upper halves */
+    while (k > order) {
+        k--;
+        free_list_insert(pn + (1 << k), k);
     }
-    mutex_unlock(&mm_lock);
-    return BAD_PA;
+    return pn;
 }
 
-void free_user_pages(pa_t pa, int num_pages) {
-    mutex_lock(&mm_lock);
-    int pn = pa_to_pn(pa);
-    int final_pn = pn, final_size = num_pages;
-
-    /* merge with prev */
-    int prev_inuse = is_page_inuse(pn - 1);
-    if (prev_inuse == 0) {
-        int old_if = save_clear_if();
-        page_foot_t* prev_foot =
-            (page_foot_t*)map_phys_page(pn_to_pa(pn - 1), NULL);
-        int prev_size = prev_foot->size;
-        restore_if(old_if);
-        int prev_pn = pn - prev_size;
-        remove_from_bins(prev_pn);
-        final_pn = prev_pn;
-        final_size += prev_size;
+/**
+ * @brief allocate a block from buddy system, must lock mm_lock before calling
+ * @param num_pages number of pages
+ * @return first page of the block, or NO_FRAME on failure
+ */
+static int alloc_block(int num_pages) {
+    int order = 0;
+    while ((1 << order) < num_pages) {
+        order++;
     }
-
-    /* merge with next */
-    int next_pn = pn + num_pages;
-    int next_inuse = is_page_inuse(next_pn);
-    if (next_inuse == 0) {
-        int old_if = save_clear_if();
-        page_head_t* next_head =
-            (page_head_t*)map_phys_page(pn_to_pa(next_pn), NULL);
-        int next_size = next_head->size;
-        restore_if(old_if);
-        remove_from_bins(next_pn);
-        final_size += next_size;
+    if (order >= NUM_ORDERS) {
+        return NO_FRAME;
     }
-
-    add_to_bins(final_pn, final_size);
-    mutex_unlock(&mm_lock);
+    int pn = alloc_order(order);
+    if (pn == NO_FRAME) {
+        /* no aligned block is large enough, try adjacent smaller blocks */
+        return alloc_unaligned(num_pages);
+    }
+    /* give back the tail if the request is not a power of 2 */
+    free_range(pn + num_pages, (1 << order) - num_pages);
+    return pn;
 }
 
-va_t map_phys_page(pa_t pa, pa_t* old_pa) {
-    pte_t* pte = get_mapped_phys_page_pte();
-    if (old_pa != NULL) {
-        *old_pa = get_page_base(*pte);
+/**
+ * @brief return some pages in current CPU's cache to buddy system, must
+ * disable interrupts before calling
+ * @param pc current CPU's page cache
+ * @param n number of pages to return
+ */
+static void drain_page_cache(page_cache_t* pc, int n) {
+    int old_if = spl_lock(&mm_lock);
+    while (n > 0 && pc->count > 0) {
+        free_block(pc->pages[--pc->count], 0);
+        n--;
     }
-    *pte = make_pte(pa, 0, PTE_SUPERVISOR, PTE_RW, PTE_PRESENT);
-    va_t va = get_mapped_phys_page();
-    invlpg(va);
-    return va;
+    scrub_pending = 1;
+    spl_unlock(&mm_lock, old_if);
 }
 
 /**
- * @brief insert a chunk to a bin
- * @param bin bin
- * @param this_chunk chunk
- * @param size size of chunk
+ * @brief allocate a single page from current CPU's cache, refill the cache from
+ * buddy system if it is empty
+ * @return the page, or NO_FRAME on failure
  */
-static void bin_insert(pa_t* bin, pa_t this_chunk, int size) {
+static int alloc_cached_page() {
+    int pn = NO_FRAME;
     int old_if = save_clear_if();
-    if (*bin == BAD_PA) {
-        page_head_t* this_head = (page_head_t*)map_phys_page(this_chunk, NULL);
-        this_head->next = this_head->prev = this_chunk;
-        this_head->size = size;
-    } else {
-        pa_t head_chunk = *bin;
-        page_head_t* head_head = (page_head_t*)map_phys_page(head_chunk, NULL);
-        pa_t tail_chunk = head_head->prev;
-        head_head->prev = this_chunk;
-        page_head_t* this_head = (page_head_t*)map_phys_page(this_chunk, NULL);
-        this_head->next = head_chunk;
-        this_head->prev = tail_chunk;
-        this_head->size = size;
-        page_head_t* tail_head = (page_head_t*)map_phys_page(tail_chunk, NULL);
-        tail_head->next = this_chunk;
+    page_cache_t* pc = &get_percpu()->page_cache;
+    if (pc->count == 0) {
+        int old_if2 = spl_lock(&mm_lock);
+        while (pc->count < PAGE_CACHE_BATCH) {
+            int new_pn = alloc_block(1);
+            if (new_pn == NO_FRAME) {
+                break;
+            }
+            pc->pages[pc->count++] = new_pn;
+        }
+        spl_unlock(&mm_lock, old_if2);
+    }
+    if (pc->count > 0) {
+        pn = pc->pages[--pc->count];
     }
     restore_if(old_if);
-    *bin = this_chunk;
+    return pn;
 }
 
 /**
- * @brief remove a chunk from a bin
- * @param bin bin
- * @param this_chunk chunk
+ * @brief take a page from the pre-zeroed pool
+ * @return the page, or NO_FRAME if the pool is empty
  */
-static void bin_delete(pa_t* bin, pa_t this_chunk) {
-    int old_if = save_clear_if();
-    page_head_t* this_head = (page_head_t*)map_phys_page(this_chunk, NULL);
-    pa_t next_chunk = this_head->next;
-    if (*bin == this_chunk) {
-        *bin = (next_chunk == this_chunk ? BAD_PA : next_chunk);
-    }
-    if (next_chunk != this_chunk) {
-        pa_t prev_chunk = this_head->prev;
-        page_head_t* next_head = (page_head_t*)map_phys_page(next_chunk, NULL);
-        next_head->prev = prev_chunk;
-        page_head_t* prev_head = (page_head_t*)map_phys_page(prev_chunk, NULL);
-        prev_head->next = next_chunk;
+static int take_zeroed_page() {
+    int pn = NO_FRAME;
+    int old_if = spl_lock(&zero_lock);
+    if (zero_pool != NO_FRAME) {
+        pn = zero_pool;
+        zero_pool = frames[pn].next;
+        zero_pool_count--;
     }
-    restore_if(old_if);
+    spl_unlock(&zero_lock, old_if);
+    return pn;
 }
 
-static void add_to_bins(int pn, int size) {
-    set_page_free(pn);
-    set_page_free(pn + (size - 1));
-    pa_t this_chunk = pn_to_pa(pn);
-    pa_t* bin = &bins[find_bin(size)];
-
-    bin_insert(bin, this_chunk, size);
+/**
+ * @brief return all pages in the pre-zeroed pool to buddy system, they keep
+ * their zeroed flag
+ */
+static void drain_zero_pool() {
+    int old_if = spl_lock(&zero_lock);
+    int pn = zero_pool;
+    zero_pool = NO_FRAME;
+    zero_pool_count = 0;
+    spl_unlock(&zero_lock, old_if);
+    old_if = spl_lock(&mm_lock);
+    while (pn != NO_FRAME) {
+        int next = frames[pn].next;
+        free_block(pn, 0);
+        pn = next;
+    }
+    spl_unlock(&mm_lock, old_if);
+}
 
+/**
+ * @brief return free pages cached by current CPU and the pre-zeroed pool to
+ * buddy system so they can be merged into large blocks
+ */
+static void reclaim_cached_pages() {
     int old_if = save_clear_if();
-    page_foot_t* this_foot =
-        (page_foot_t*)map_phys_page(pn_to_pa(pn + (size - 1)), NULL);
-    this_foot->size = size;
+    page_cache_t* pc = &get_percpu()->page_cache;
+    drain_page_cache(pc, pc->count);
     restore_if(old_if);
+    drain_zero_pool();
 }
 
-static void remove_from_bins(int pn) {
-    pa_t this_chunk = pn_to_pa(pn);
+/* a held mapping is never reused by nested users, so this is safe when called
+ * from interrupt handlers */
+static void clear_page(int pn) {
     int old_if = save_clear_if();
-    page_head_t* this_head = (page_head_t*)map_phys_page(this_chunk, NULL);
-    int size = this_head->size;
+    void* page = (void*)kmap(pn_to_pa(pn));
+    memset(page, 0, PAGE_SIZE);
+    kunmap((va_t)page);
     restore_if(old_if);
-    pa_t* bin = &bins[find_bin(size)];
-    bin_delete(bin, this_chunk);
 }
 
-static pa_t alloc_from_bin(pa_t* bin, int size) {
-    if (*bin == BAD_PA) {
+/**
+ * @brief find a dirty free frame in buddy system, take it out, zero it and put
+ * it back
+ * @return 0 on success, -1 if no dirty frame is found
+ */
+static int scrub_free_page() {
+    int old_if = spl_lock(&mm_lock);
+    int i;
+    for (i = 0; scrub_pending != 0 && i < SCRUB_SCAN_LIMIT; i++) {
+        int pn = scrub_cursor;
+        if (++scrub_cursor == num_user_pages) {
+            /* a full pass is done, wait for next dirty frame */
+            scrub_cursor = 0;
+            scrub_pending = 0;
+        }
+        if ((frames[pn].flags & FRAME_ZEROED) != 0) {
+            continue;
+        }
+        /* find the free block containing pn */
+        int order, head = NO_FRAME;
+        for (order = 0; order < NUM_ORDERS; order++) {
+            int h = (pn & (~((1 << order) - 1)));
+            if (frames[h].order == order) {
+                head = h;
+                break;
+            }
+        }
+        if (head == NO_FRAME) {
+            continue;
+        }
+        /* split the block until only pn is taken */
+        free_list_delete(head);
+        while (order > 0) {
+            order--;
+            if (pn < head + (1 << order)) {
+                free_list_insert(head + (1 << order), order);
+            } else {
+                free_list_insert(head, order);
+                head += (1 << order);
+            }
+        }
+        spl_unlock(&mm_lock, old_if);
+        clear_page(pn);
+        frames[pn].flags = FRAME_ZEROED;
+        old_if = spl_lock(&mm_lock);
+        free_block(pn, 0);
+        spl_unlock(&mm_lock, old_if);
+        return 0;
+    }
+    spl_unlock(&mm_lock, old_if);
+    return -1;
+}
+
+pa_t alloc_user_pages(int num_pages) {
+    if (num_pages <= 0) {
+        return BAD_PA;
+    }
+    int pn;
+    if (num_pages == 1) {
+        pn = alloc_cached_page();
+        if (pn == NO_FRAME) {
+            pn = take_zeroed_page();
+        }
+    } else {
+        int old_if = spl_lock(&mm_lock);
+        pn = alloc_block(num_pages);
+        spl_unlock(&mm_lock, old_if);
+        if (pn == NO_FRAME) {
+            /* pages held by this CPU's cache may fill the gap */
+            reclaim_cached_pages();
+            old_if = spl_lock(&mm_lock);
+            pn = alloc_block(num_pages);
+            spl_unlock(&mm_lock, old_if);
+        }
+    }
+    if (pn == NO_FRAME) {
         return BAD_PA;
     }
-    pa_t r_pa = BAD_PA;
-    pa_t r_pn = 0;
-    pa_t this_chunk = *bin, end = *bin;
-    do {
+    /* nobody else can see these pages yet */
+    int i;
+    for (i = 0; i < num_pages; i++) {
+        frames[pn + i].refcount = 1;
+    }
+    return pn_to_pa(pn);
+}
+
+pa_t alloc_huge_user_page() {
+    int old_if = spl_lock(&mm_lock);
+    int pn = alloc_order(HUGE_PAGE_ORDER);
+    spl_unlock(&mm_lock, old_if);
+    if (pn == NO_FRAME) {
+        reclaim_cached_pages();
+        old_if = spl_lock(&mm_lock);
+        pn = alloc_order(HUGE_PAGE_ORDER);
+        spl_unlock(&mm_lock, old_if);
+        if (pn == NO_FRAME) {
+            return BAD_PA;
+        }
+    }
+    /* only the first frame's reference count is used */
+    frames[pn].refcount = 1;
+    frames[pn].flags |= FRAME_HUGE;
+    return pn_to_pa(pn);
+}
+
+void free_user_pages(pa_t pa, int num_pages) {
+    int i, pn = pa_to_pn(pa);
+    for (i = 0; i < num_pages; i++) {
+        frames[pn + i].flags = 0;
+        frames[pn + i].live = 0;
+    }
+    if (num_pages == 1) {
         int old_if = save_clear_if();
-        page_head_t* this_head = (page_head_t*)map_phys_page(this_chunk, NULL);
-        int this_size = this_head->size;
-        pa_t next_chunk = this_head->next;
+        page_cache_t* pc = &get_percpu()->page_cache;
+        if (pc->count == PAGE_CACHE_SIZE) {
+            drain_page_cache(pc, PAGE_CACHE_BATCH);
+        }
+        pc->pages[pc->count++] = pn;
         restore_if(old_if);
-        if (this_size > size) {
-            bin_delete(bin, this_chunk);
-            r_pa = this_chunk;
-            r_pn = pa_to_pn(r_pa);
-            add_to_bins(r_pn + size, this_size - size);
-            break;
-        } else if (this_size == size) {
-            bin_delete(bin, this_chunk);
-            r_pa = this_chunk;
-            r_pn = pa_to_pn(r_pa);
+        return;
+    }
+    int old_if = spl_lock(&mm_lock);
+    free_range(pn, num_pages);
+    scrub_pending = 1;
+    spl_unlock(&mm_lock, old_if);
+}
+
+pa_t alloc_zeroed_user_page() {
+    int pn = take_zeroed_page();
+    if (pn != NO_FRAME) {
+        frames[pn].refcount = 1;
+        frames[pn].flags = 0;
+        return pn_to_pa(pn);
+    }
+    pa_t pa = alloc_user_pages(1);
+    if (pa != BAD_PA) {
+        zero_user_pages(pa, 1);
+    }
+    return pa;
+}
+
+int alloc_zeroed_user_pages(pa_t* pages, int num_pages) {
+    int i = 0, j;
+    int old_if = spl_lock(&zero_lock);
+    while (i < num_pages && zero_pool != NO_FRAME) {
+        int pn = zero_pool;
+        zero_pool = frames[pn].next;
+        zero_pool_count--;
+        pages[i++] = pn_to_pa(pn);
+    }
+    spl_unlock(&zero_lock, old_if);
+    for (j = 0; j < i; j++) {
+        int pn = pa_to_pn(pages[j]);
+        frames[pn].refcount = 1;
+        frames[pn].flags = 0;
+    }
+    for (; i < num_pages; i++) {
+        pa_t pa = alloc_user_pages(1);
+        if (pa == BAD_PA) {
+            goto alloc_fail;
+        }
+        zero_user_pages(pa, 1);
+        pages[i] = pa;
+    }
+    return 0;
+
+alloc_fail:
+    for (j = 0; j < i; j++) {
+        free_user_pages(pages[j], 1);
+    }
+    return -1;
+}
+
+void zero_user_pages(pa_t pa, int num_pages) {
+    int i, pn = pa_to_pn(pa);
+    for (i = 0; i < num_pages; i++) {
+        if ((frames[pn + i].flags & FRAME_ZEROED) == 0) {
+            clear_page(pn + i);
+        }
+        frames[pn + i].flags &= (~FRAME_ZEROED);
+    }
+}
+
+int refill_zeroed_pages() {
+    int i;
+    for (i = 0; i < ZERO_BATCH; i++) {
+        if (zero_pool_count < ZERO_POOL_SIZE) {
+            pa_t pa = alloc_user_pages(1);
+            if (pa == BAD_PA) {
+                return 0;
+            }
+            int pn = pa_to_pn(pa);
+            if ((frames[pn].flags & FRAME_ZEROED) == 0) {
+                clear_page(pn);
+            }
+            int old_if = spl_lock(&zero_lock);
+            frames[pn].flags = FRAME_ZEROED;
+            frames[pn].next = zero_pool;
+            zero_pool = pn;
+            zero_pool_count++;
+            spl_unlock(&zero_lock, old_if);
+        } else if (scrub_free_page() != 0) {
+            /* pool is full and all free frames are zeroed */
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void get_user_page(pa_t pa) {
+    /* zero page is shared by everyone and never freed */
+    if (pa == zero_page) {
+        return;
+    }
+    atomic_add(&frames[pa_to_pn(pa)].refcount, 1);
+}
+
+void put_user_page(pa_t pa) {
+    if (pa == zero_page) {
+        return;
+    }
+    frame_t* f = &frames[pa_to_pn(pa)];
+    /* nobody can clear the flag while we hold a reference */
+    int num_pages = ((f->flags & FRAME_HUGE) != 0 ? HUGE_PAGE_PAGES : 1);
+    if (atomic_add(&f->refcount, -1) == 0) {
+        free_user_pages(pa, num_pages);
+    }
+}
+
+void put_user_pt(pa_t pt) {
+    int i;
+    for (i = 0; i < NUM_PAGE_ENTRY; i++) {
+        /* the slot is kept between entries unless a freed page needs it */
+        int old_if = save_clear_if();
+        pte_t* entries = (pte_t*)kmap(pt);
+        pte_t pte = entries[i];
+        kunmap((va_t)entries);
+        restore_if(old_if);
+        if (pte != BAD_PTE) {
+            put_user_page(get_page_base(pte));
+        }
+    }
+    put_user_page(pt);
+}
+
+int get_user_page_refcount(pa_t pa) {
+    return frames[pa_to_pn(pa)].refcount;
+}
+
+int adjust_pt_entries(pa_t pt, int delta) {
+    frame_t* f = &frames[pa_to_pn(pt)];
+    f->live += delta;
+    assert(f->live >= 0 && f->live <= NUM_PAGE_ENTRY);
+    return f->live;
+}
+
+va_t kmap(pa_t pa) {
+    int old_if = save_clear_if();
+    percpu_t* percpu = get_percpu();
+    kmap_t* km = &percpu->kmap;
+    int i, slot = -1;
+    for (i = 0; i < KMAP_SLOTS; i++) {
+        if (km->pa[i] == pa) {
+            slot = i;
             break;
         }
-        this_chunk = next_chunk;
-    } while (this_chunk != end);
-    if (r_pa == BAD_PA) {
-        return BAD_PA;
     }
-    set_page_inuse(r_pn);
-    set_page_inuse(r_pn + (size - 1));
-    return r_pa;
+    if (slot == -1) {
+        /* ages are compared instead of clocks so wrap around is harmless */
+        unsigned int oldest = 0;
+        for (i = 0; i < KMAP_SLOTS; i++) {
+            unsigned int age = km->clock - km->last_use[i];
+            if (km->refcount[i] == 0 && (slot == -1 || age > oldest)) {
+                slot = i;
+                oldest = age;
+            }
+        }
+        if (slot == -1) {
+            panic("all %d physical page mapping slots are in use", KMAP_SLOTS);
+        }
+        percpu->mapped_phys_page_pte[slot] =
+            make_pte(pa, 0, PTE_SUPERVISOR, PTE_RW, PTE_PRESENT);
+        invlpg(percpu->mapped_phys_page + slot * PAGE_SIZE);
+        km->pa[slot] = pa;
+    }
+    km->refcount[slot]++;
+    km->last_use[slot] = ++km->clock;
+    restore_if(old_if);
+    return percpu->mapped_phys_page + slot * PAGE_SIZE;
+}
+
+void kunmap(va_t va) {
+    int old_if = save_clear_if();
+    percpu_t* percpu = get_percpu();
+    int slot = (va - percpu->mapped_phys_page) / PAGE_SIZE;
+    assert(slot >= 0 && slot < KMAP_SLOTS && percpu->kmap.refcount[slot] > 0);
+    percpu->kmap.refcount[slot]--;
+    restore_if(old_if);
+}
+
+va_t map_phys_page(pa_t pa) {
+    va_t va = kmap(pa);
+    kunmap(va);
+    return va;
 }
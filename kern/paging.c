@@ -21,45 +21,82 @@
 #include <paging.h>
 #include <sched.h>
 
-/** number of page tables for kernel memory */
-#define NUM_KERNEL_PT (USER_MEM_START / PAGE_SIZE / NUM_PAGE_ENTRY)
+/** number of page directory entries for kernel memory */
+#define NUM_KERNEL_PDE (USER_MEM_START / PT_SIZE)
 
 page_directory_t* kernel_pd;
-/** page tables for kernel memory */
+/** page tables for the physical page mapping area, the only kernel memory
+ * besides LAPIC page mapped by 4KB pages */
 static page_table_t* kernel_pt;
 
 va_t mapped_phys_pages;
 pte_t* mapped_phys_page_ptes;
 
-void paging_init() {
-    kernel_pd = (page_directory_t*)_smemalign(PAGE_SIZE, PAGE_SIZE);
-    kernel_pt = (page_table_t*)_smemalign(PAGE_SIZE, PAGE_SIZE * NUM_KERNEL_PT);
+/**
+ * @brief replace a 4MB kernel page by a page table with the same mappings
+ * @param index index of page directory entry
+ * @param pt the page table
+ */
+static void split_kernel_pde(int index, page_table_t* pt) {
+    int i;
+    pa_t base = index * PT_SIZE;
+    for (i = 0; i < NUM_PAGE_ENTRY; i++) {
+        (*pt)[i] = make_pte(base + i * PAGE_SIZE, PTE_G, PTE_SUPERVISOR, PTE_RW,
+                            PTE_PRESENT);
+    }
+    (*kernel_pd)[index] =
+        make_pde((pa_t)pt, PTE_SUPERVISOR, PTE_RW, PTE_PRESENT);
+}
 
+void paging_init() {
     int num_cpus = smp_num_cpus();
-    mapped_phys_pages = (va_t)_smemalign(PAGE_SIZE, num_cpus * PAGE_SIZE);
-    mapped_phys_page_ptes = (pte_t*)kernel_pt + (mapped_phys_pages / PAGE_SIZE);
-
-    if (kernel_pd == NULL || kernel_pt == NULL || mapped_phys_pages == 0 ||
-        mapped_phys_page_ptes == NULL) {
+    va_size_t mapped_size = num_cpus * KMAP_SLOTS * PAGE_SIZE;
+    kernel_pd = (page_directory_t*)_smemalign(PAGE_SIZE, PAGE_SIZE);
+    mapped_phys_pages = (va_t)_smemalign(PAGE_SIZE, mapped_size);
+    if (kernel_pd == NULL || mapped_phys_pages == 0) {
+        panic("no space for kernel page table");
+    }
+    /* page tables of the mapping area are contiguous, so its ptes can be
+     * indexed linearly even if it crosses a 4MB boundary
+     */
+    int first_pt = get_pd_index(mapped_phys_pages);
+    int last_pt = get_pd_index(mapped_phys_pages + mapped_size - 1);
+    kernel_pt = (page_table_t*)_smemalign(
+        PAGE_SIZE, PAGE_SIZE * (last_pt - first_pt + 1));
+    if (kernel_pt == NULL) {
         panic("no space for kernel page table");
     }
 
-    int i, j;
-    pa_t base = 0;
+    int i;
     memset(kernel_pd, 0, sizeof(page_directory_t));
-    for (i = 0; i < (USER_MEM_START / PT_SIZE); i++) {
-        (*kernel_pd)[i] =
-            make_pde((pa_t)&kernel_pt[i], PTE_SUPERVISOR, PTE_RW, PTE_PRESENT);
-        for (j = 0; j < NUM_PAGE_ENTRY; j++) {
-            kernel_pt[i][j] =
-                make_pte(base, PTE_G, PTE_SUPERVISOR, PTE_RW, PTE_PRESENT);
-            base += PAGE_SIZE;
-        }
+    for (i = 0; i < NUM_KERNEL_PDE; i++) {
+        (*kernel_pd)[i] = make_large_pde(i * PT_SIZE, PTE_G, PTE_SUPERVISOR,
+                                         PTE_RW, PTE_PRESENT);
+    }
+    for (i = first_pt; i <= last_pt; i++) {
+        split_kernel_pde(i, &kernel_pt[i - first_pt]);
     }
+    mapped_phys_page_ptes = (pte_t*)kernel_pt +
+                            (mapped_phys_pages / PAGE_SIZE -
+                             first_pt * NUM_PAGE_ENTRY);
 
+    /* kernel threads run with kernel_pd, keep its self mapping valid */
+    (*kernel_pd)[SELF_PD_INDEX] =
+        make_pde((pa_t)kernel_pd, PTE_SUPERVISOR, PTE_RW, PTE_PRESENT);
+
+    int lapic_index = get_pd_index(LAPIC_VIRT_BASE);
+    page_table_t* lapic_pt;
+    if (lapic_index >= first_pt && lapic_index <= last_pt) {
+        lapic_pt = &kernel_pt[lapic_index - first_pt];
+    } else {
+        lapic_pt = (page_table_t*)_smemalign(PAGE_SIZE, PAGE_SIZE);
+        if (lapic_pt == NULL) {
+            panic("no space for kernel page table");
+        }
+        split_kernel_pde(lapic_index, lapic_pt);
+    }
     pa_t lapic_pa = (pa_t)smp_lapic_base();
-    pte_t* lapic_pte = (pte_t*)kernel_pt + (LAPIC_VIRT_BASE / PAGE_SIZE);
-    *lapic_pte =
+    (*lapic_pt)[get_pt_index(LAPIC_VIRT_BASE)] =
         (make_pte(lapic_pa, PTE_G, PTE_SUPERVISOR, PTE_RW, PTE_PRESENT) |
          (PTE_PWT << PTE_PWT_SHIFT) | (PTE_PCD << PTE_PCD_SHIFT));
 
@@ -12,6 +12,7 @@
 #include <paging.h>
 #include <pv.h>
 #include <sched.h>
+#include <tlb.h>
 #include <usermem.h>
 
 static int create_boot_pd(process_t* p, pa_t bootmem, int n_pages);
@@ -41,31 +42,10 @@ static int create_boot_pd(process_t* p, pa_t bootmem, int n_pages) {
     queue_insert_head(&p->pv->shadow_pds, &pv_pd->pv_link);
     p->pv->active_shadow_pd = pv_pd;
 
-    int i = 0;
-    int offset = 0;
-    va_t m_start = USER_MEM_START;
-    pa_t pt_pa = find_or_create_pt(p, m_start);
-    if (pt_pa == BAD_PA) {
+    if (map_user_range(p, USER_MEM_START, bootmem, n_pages, 1) != 0) {
         goto add_pt_fail;
     }
-    do {
-        offset = i * PAGE_SIZE;
-        int pt_index = get_pt_index(m_start + offset);
-        if (pt_index == 0) {
-            /* step to next page table */
-            pt_pa = find_or_create_pt(p, m_start + offset);
-            if (pt_pa == BAD_PA) {
-                goto add_pt_fail;
-            }
-        }
-        int old_if = save_clear_if();
-        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
-        (*pt)[pt_index] =
-            make_pte(bootmem + offset, 0, PTE_USER, PTE_RW, PTE_PRESENT);
-        restore_if(old_if);
-        invlpg(m_start + offset);
-    } while (++i < n_pages);
-    memset((char*)USER_MEM_START, 0, n_pages * PAGE_SIZE);
+    zero_user_pages(bootmem, n_pages);
     return 0;
 
 add_pt_fail:
@@ -83,6 +63,8 @@ thread_t* create_pv_process(thread_t* t,
         goto alloc_pv_fail;
     }
     pv->shadow_pds = NULL;
+    pv->mem_base = BAD_PA;
+    pv->n_pages = 0;
     pv->vif = 0;
     memset(&pv->vidt, 0, sizeof(pv_idt_t));
 
@@ -99,14 +81,14 @@ thread_t* create_pv_process(thread_t* t,
     }
     pv->n_pages = n_bootmem_pages;
     pv->mem_base = bootmem;
-    if (add_region(p, USER_MEM_START, n_bootmem_pages, bootmem, 1) != 0) {
+    if (add_region(p, USER_MEM_START, n_bootmem_pages, 1) != 0) {
         goto alloc_region_fail;
     }
 
     /* temporarily use new process's cr3 to load elf */
     pa_t old_cr3 = get_current()->process->cr3;
     get_current()->process->cr3 = p->cr3;
-    set_cr3(p->cr3);
+    load_cr3(p->cr3);
 
     if (create_boot_pd(p, bootmem, n_bootmem_pages) != 0) {
         goto create_boot_pd_fail;
@@ -137,7 +119,7 @@ thread_t* create_pv_process(thread_t* t,
     }
 
     get_current()->process->cr3 = old_cr3;
-    set_cr3(old_cr3);
+    load_cr3(old_cr3);
 
     t->kernel_esp -= sizeof(stack_frame_t);
     stack_frame_t* frame = (stack_frame_t*)t->kernel_esp;
@@ -167,10 +149,10 @@ thread_t* create_pv_process(thread_t* t,
 load_elf_fail:
 create_boot_pd_fail:
     get_current()->process->cr3 = old_cr3;
-    set_cr3(old_cr3);
-    vector_pop(&p->regions);
+    load_cr3(old_cr3);
+    remove_region(p, p->cr3, find_region(p, USER_MEM_START));
 alloc_region_fail:
-    free_user_pages(bootmem, n_bootmem_pages);
+    /* bootmem is freed with pv */
 alloc_bootmem_fail:
 alloc_pv_fail:
     destroy_thread(t);
@@ -191,6 +173,9 @@ void destroy_pv(pv_t* pv) {
             sfree(pv_pd, sizeof(pv_pd_t));
         } while (node != end);
     }
+    if (pv->mem_base != BAD_PA) {
+        free_user_pages(pv->mem_base, pv->n_pages);
+    }
     sfree(pv, sizeof(pv_t));
 }
 
@@ -206,7 +191,7 @@ void pv_switch_mode(process_t* p, int kernelmode) {
     pv_pd_t* pv_pd = p->pv->active_shadow_pd;
     pa_t target_cr3 = (kernelmode != 0 ? pv_pd->cr3 : pv_pd->user_cr3);
     p->cr3 = target_cr3;
-    set_cr3(target_cr3);
+    load_cr3(target_cr3);
 }
 
 void pv_select_pd(process_t* p, pv_pd_t* pv_pd) {
@@ -215,7 +200,7 @@ void pv_select_pd(process_t* p, pv_pd_t* pv_pd) {
     pv->active_shadow_pd = pv_pd;
     pv_pd->refcount++;
     p->cr3 = pv_pd->cr3;
-    set_cr3(p->cr3);
+    load_cr3(p->cr3);
     old_pv_pd->refcount--;
     if (old_pv_pd->refcount == 0) {
         queue_detach(&pv->shadow_pds, &old_pv_pd->pv_link);
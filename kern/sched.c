@@ -7,7 +7,9 @@
  */
 
 #include <limits.h>
+#include <apic.h>
 #include <malloc_internal.h>
+#include <smp.h>
 #include <string.h>
 #include <x86/asm.h>
 #include <x86/cr.h>
@@ -23,9 +25,9 @@
 #include <pv.h>
 #include <sched.h>
 #include <sync.h>
-
-/* .text, .rodata, .data+bss, stack and a heap and one for future new_pages */
-#define INIT_NUM_REGIONS 6
+#include <syscall_ext_int.h>
+#include <timer.h>
+#include <tlb.h>
 
 /**
  * @brief load a elf to memory space
@@ -36,7 +38,8 @@
  */
 static int process_load_elf(process_t* p, simple_elf_t* elf, char* exe);
 /**
- * @brief load a elf segment to memory space
+ * @brief add a elf segment to memory space, its content is read in from file
+ * when pages are first touched
  * @param p process
  * @param f elf file entry, NULL for empty segments
  * @param offset offset in elf file
@@ -56,8 +59,12 @@ static int load_segment(process_t* p,
 
 process_t* init_process;
 
-spl_t ready_lock = SPL_INIT;
-queue_t* ready = NULL;
+/** run queues of all CPUs, indexed by CPU number */
+static run_queue_t* run_queues[MAX_CPUS];
+int reserved_cpus = 0;
+
+/** percpu structures of all CPUs, indexed by CPU number */
+static percpu_t* percpus[MAX_CPUS];
 
 rb_t* threads = &rb_nil;
 mutex_t threads_lock = MUTEX_INIT;
@@ -80,6 +87,11 @@ void setup_percpu(percpu_t* percpu) {
     gdt[SEGSEL_KERNEL_FS_IDX] =
         create_segsel((va_t)percpu, sizeof(percpu_t) - 1, ds_flags);
     set_fs(SEGSEL_KERNEL_FS);
+    memset(percpu, 0, sizeof(percpu_t));
+    set_percpu(percpu);
+    percpu->rq.lock = SPL_INIT;
+    run_queues[smp_get_cpu()] = &percpu->rq;
+    percpus[smp_get_cpu()] = percpu;
 }
 
 void setup_kth(thread_t* kthread, process_t* kprocess) {
@@ -88,6 +100,7 @@ void setup_kth(thread_t* kthread, process_t* kprocess) {
     kprocess->refcount = 1;
     kprocess->cr3 = (pa_t)kernel_pd;
     kthread->process = kprocess;
+    kthread->affinity = ALL_CPUS;
     kthread->pts = active_pts;
     set_current(kthread);
     set_kthread(kthread);
@@ -122,28 +135,29 @@ thread_t* create_empty_process() {
     p->nwaiters = 0;
     p->wait_lock = MUTEX_INIT;
     p->wait_cv = CV_INIT;
-    if (vector_init(&p->regions, sizeof(region_t), INIT_NUM_REGIONS) != 0) {
-        goto alloc_region_fail;
-    }
+    p->regions = &rb_nil;
 
-    p->cr3 = alloc_user_pages(1);
+    p->cr3 = alloc_zeroed_user_page();
     if (p->cr3 == 0) {
         goto alloc_pd_fail;
     }
     int old_if = save_clear_if();
-    page_directory_t* pd = (page_directory_t*)map_phys_page(p->cr3, NULL);
-    memset(pd, 0, PAGE_SIZE);
+    page_directory_t* pd = (page_directory_t*)map_phys_page(p->cr3);
     int i;
     /* copy kernel direct mapping */
     for (i = 0; i < USER_PD_START; i++) {
         (*pd)[i] = (*kernel_pd)[i];
     }
+    (*pd)[SELF_PD_INDEX] =
+        make_pde(p->cr3, PTE_SUPERVISOR, PTE_RW, PTE_PRESENT);
     restore_if(old_if);
     p->mm_lock = MUTEX_INIT;
     p->pv = NULL;
 
     t->status = THREAD_DEAD;
     t->status_lock = SPL_INIT;
+    t->cpu = smp_get_cpu();
+    t->affinity = get_current()->affinity;
     t->pending_exit = 0;
     queue_insert_head(&p->threads, &t->process_link);
     t->rb_node.parent = NULL; /* mark that the thread is not added to rbtree */
@@ -159,8 +173,6 @@ thread_t* create_empty_process() {
     return t;
 
 alloc_pd_fail:
-    vector_free(&p->regions);
-alloc_region_fail:
     sfree(t->stack, K_STACK_SIZE);
 alloc_thread_stack_fail:
     sfree(t, sizeof(thread_t));
@@ -219,6 +231,9 @@ static int process_load_elf(process_t* p, simple_elf_t* elf, char* exe) {
     if (load_segment(p, NULL, 0, 0, DEFAULT_STACK_POS, DEFAULT_STACK_SIZE, 1)) {
         goto load_segment_fail;
     }
+    /* faults below the stack grow it instead of bouncing to user space */
+    find_region(p, DEFAULT_STACK_POS)->grow_limit =
+        DEFAULT_STACK_END - INITIAL_STACK_LIMIT;
     return 0;
 
 load_segment_fail:
@@ -252,10 +267,12 @@ thread_t* create_process(int tid, char* exe, int argc, const char** argv) {
         return create_pv_process(t, &elf, exe, mem_size);
     }
 
-    /* temporarily use new process's cr3 to load elf */
-    pa_t old_cr3 = get_current()->process->cr3;
-    get_current()->process->cr3 = t->process->cr3;
-    set_cr3(t->process->cr3);
+    /* temporarily run in new process to load elf and arguments, so faults on
+     * its memory are handled with its regions
+     */
+    process_t* old_p = get_current()->process;
+    get_current()->process = t->process;
+    load_cr3(t->process->cr3);
 
     if (process_load_elf(t->process, &elf, exe) != 0) {
         goto load_elf_fail;
@@ -294,8 +311,8 @@ thread_t* create_process(int tid, char* exe, int argc, const char** argv) {
     new_esp[3] = DEFAULT_STACK_END; /* stack_hi */
     new_esp[4] = DEFAULT_STACK_POS; /* stack_lo */
 
-    get_current()->process->cr3 = old_cr3;
-    set_cr3(old_cr3);
+    get_current()->process = old_p;
+    load_cr3(old_p->cr3);
 
     t->kernel_esp -= sizeof(stack_frame_t);
     stack_frame_t* frame = (stack_frame_t*)t->kernel_esp;
@@ -324,8 +341,8 @@ thread_t* create_process(int tid, char* exe, int argc, const char** argv) {
 
 alloc_argc_addr_fail:
 load_elf_fail:
-    get_current()->process->cr3 = old_cr3;
-    set_cr3(old_cr3);
+    get_current()->process = old_p;
+    load_cr3(old_p->cr3);
 bad_mem_size_for_pv:
 too_many_args_for_pv:
 open_elf_fail:
@@ -352,12 +369,7 @@ void destroy_thread(thread_t* t) {
         return;
     }
     mutex_unlock(&p->refcount_lock);
-    int i, n = vector_size(&p->regions);
-    for (i = 0; i < n; i++) {
-        region_t* r = (region_t*)vector_at(&p->regions, i);
-        free_user_pages(r->paddr, r->size / PAGE_SIZE);
-    }
-    vector_free(&p->regions);
+    remove_all_regions(p, p->cr3);
     /** PV guests' page tables are managed by pv_pd_t */
     if (p->pv == NULL) {
         destroy_pd(p->cr3);
@@ -371,8 +383,10 @@ void destroy_pd(pa_t pd_pa) {
     int i;
     int old_if = save_clear_if();
     for (i = USER_PD_START; i < NUM_PAGE_ENTRY; i++) {
-        page_directory_t* pd = (page_directory_t*)map_phys_page(pd_pa, NULL);
-        if ((*pd)[i] != BAD_PDE) {
+        page_directory_t* pd = (page_directory_t*)map_phys_page(pd_pa);
+        /* the self mapping slot and huge pages are not page tables */
+        if ((*pd)[i] != BAD_PDE && !is_large_pde((*pd)[i]) &&
+            get_page_table((*pd)[i]) != pd_pa) {
             pa_t pt = get_page_table((*pd)[i]);
             free_user_pages(pt, 1);
         }
@@ -431,175 +445,885 @@ static int load_segment(process_t* p,
     va_t m_start = (m_off & PAGE_BASE_MASK);
     va_t m_end = ((m_off + m_len + (PAGE_SIZE - 1)) & PAGE_BASE_MASK);
     int n_pages = (m_end - m_start) / PAGE_SIZE;
-    pa_t paddr = alloc_user_pages(n_pages);
-    if (paddr == 0) {
-        goto alloc_segment_fail;
-    }
+    /* file content is read in when pages are first touched, read only pages
+     * are shared by all processes running f
+     */
+    file_map_t file = {f, f_off, f_len, m_off};
     /* handle address check and overlapping issues */
-    if (add_region(p, m_start, n_pages, paddr, is_rw) != 0) {
-        goto add_region_fail;
-    }
-
-    int i = 0;
-    int offset = 0;
-    /* file page table one entry per loop */
-    pa_t pt_pa = find_or_create_pt(p, m_start);
-    if (pt_pa == BAD_PA) {
-        goto add_pt_fail;
-    }
-    do {
-        offset = i * PAGE_SIZE;
-        int pt_index = get_pt_index(m_start + offset);
-        if (pt_index == 0) {
-            /* step to next page table */
-            pt_pa = find_or_create_pt(p, m_start + offset);
-            if (pt_pa == BAD_PA) {
-                goto add_pt_fail;
-            }
+    return add_file_region(p, m_start, n_pages, is_rw, &file);
+}
+
+pa_t find_or_create_pt(process_t* p, va_t vaddr) {
+    int old_if = save_clear_if();
+    page_directory_t* pd = map_user_pd(p, p->cr3);
+    pde_t* pde = &(*pd)[get_pd_index(vaddr)];
+    if (*pde == BAD_PDE) {
+        /* add a page table */
+        pa_t pt = alloc_zeroed_user_page();
+        if (pt == 0) {
+            restore_if(old_if);
+            return 0;
         }
+        pd = map_user_pd(p, p->cr3);
+        pde = &(*pd)[get_pd_index(vaddr)];
+        /* the entry was not present, so neither vaddr nor the self mapping
+         * of the page table can be cached in TLB
+         */
+        *pde = make_pde(pt, PTE_USER, PTE_RW, PTE_PRESENT);
+        restore_if(old_if);
+        return pt;
+    }
+    if (is_large_pde(*pde)) {
+        /* the whole page table range is mapped by a huge page */
+        restore_if(old_if);
+        return BAD_PA;
+    }
+    pa_t result = get_page_table(*pde);
+    restore_if(old_if);
+    return result;
+}
 
-        int old_if = save_clear_if();
-        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
-        /* do not set P bit for ZFOD */
-        (*pt)[pt_index] = make_pte(paddr + offset, 0, PTE_USER, PTE_RW, 0);
+void release_region(process_t* p, pa_t cr3, region_t* r) {
+    /* PV guest memory is owned by pv_t and mapped by guest's page tables */
+    if (p->pv != NULL) {
+        return;
+    }
+    /* page tables are the only record of the backing pages, which may be
+     * shared with other processes by copy-on-write, so walk them and drop one
+     * reference per mapped page
+     */
+    unmap_user_range(p, cr3, r->addr, r->size / PAGE_SIZE);
+}
+
+/**
+ * @brief get number of pages of a range in the page table covering vaddr
+ * @param vaddr page aligned virtual address
+ * @param n_pages number of pages in the range
+ * @return number of pages from vaddr to the end of range or page table
+ */
+static int range_chunk(va_t vaddr, int n_pages) {
+    int n = (int)NUM_PAGE_ENTRY - get_pt_index(vaddr);
+    return (n < n_pages ? n : n_pages);
+}
+
+/**
+ * @brief get the page directory entry covering vaddr, interrupts must be
+ * disabled unless the page directory is in use
+ * @param p the process
+ * @param cr3 page directory
+ * @param vaddr virtual address
+ * @return pointer to the page directory entry
+ */
+static pde_t* find_user_pde(process_t* p, pa_t cr3, va_t vaddr) {
+    return &(*map_user_pd(p, cr3))[get_pd_index(vaddr)];
+}
+
+/**
+ * @brief get the page table covering vaddr if it is present, interrupts must
+ * be disabled unless the page directory is in use
+ * @param p the process
+ * @param cr3 page directory
+ * @param vaddr virtual address
+ * @param pt_pa where to save physical address of the page table, can be NULL
+ * @return the page table, NULL if not present or a huge page is mapped instead
+ */
+static page_table_t* find_user_pt(process_t* p,
+                                  pa_t cr3,
+                                  va_t vaddr,
+                                  pa_t* pt_pa) {
+    pde_t pde = *find_user_pde(p, cr3, vaddr);
+    if (pde == BAD_PDE || is_large_pde(pde)) {
+        return NULL;
+    }
+    if (pt_pa != NULL) {
+        *pt_pa = get_page_table(pde);
+    }
+    return map_user_pt(p, cr3, vaddr, get_page_table(pde));
+}
+
+/**
+ * @brief clear the page directory entry of a page table with no present entry,
+ * the page table is freed after TLB entries are flushed
+ * @param p the process
+ * @param vaddr any virtual address covered by the page table
+ * @param pt_pa physical address of the page table
+ * @param batch the TLB batch of current operation
+ */
+static void free_user_pt(process_t* p,
+                         va_t vaddr,
+                         pa_t pt_pa,
+                         tlb_batch_t* batch) {
+    int old_if = save_clear_if();
+    *find_user_pde(p, batch->cr3, vaddr) = BAD_PDE;
+    restore_if(old_if);
+    /* cached walks through the page table and its self mapping must be
+     * dropped before the frame can be reused
+     */
+    tlb_batch_add_pde(batch, pt_pa);
+}
+
+/**
+ * @brief clear the page directory entry of a page table covered by a range as
+ * a whole, the pages it maps and the page table are released after TLB entries
+ * are flushed, without touching its entries before
+ * @param p the process
+ * @param vaddr any virtual address covered by the page table
+ * @param batch the TLB batch of current operation
+ * @return 0 on success, -1 if no page table is present
+ */
+static int detach_user_pt(process_t* p, va_t vaddr, tlb_batch_t* batch) {
+    int old_if = save_clear_if();
+    pde_t* pde = find_user_pde(p, batch->cr3, vaddr);
+    pde_t old_pde = *pde;
+    if (old_pde == BAD_PDE || is_large_pde(old_pde)) {
+        restore_if(old_if);
+        return -1;
+    }
+    *pde = BAD_PDE;
+    restore_if(old_if);
+    tlb_batch_add_pt(batch, get_page_table(old_pde));
+    return 0;
+}
+
+/**
+ * @brief unmap the huge page covering vaddr, its reference is dropped after
+ * TLB entries are flushed
+ * @param p the process
+ * @param vaddr virtual address
+ * @param batch the TLB batch of current operation
+ * @return 0 on success, -1 if vaddr is not mapped by a huge page
+ */
+static int unmap_huge_page(process_t* p, va_t vaddr, tlb_batch_t* batch) {
+    int old_if = save_clear_if();
+    pde_t* pde = find_user_pde(p, batch->cr3, vaddr);
+    pde_t old_pde = *pde;
+    if (!is_large_pde(old_pde)) {
         restore_if(old_if);
-        invlpg(m_start + offset);
-    } while (++i < n_pages);
+        return -1;
+    }
+    *pde = BAD_PDE;
+    restore_if(old_if);
+    /* the self mapping of the slot may alias the page as well */
+    tlb_batch_add_pde(batch, get_large_page_base(old_pde));
+    return 0;
+}
 
-    if (f != NULL) {
-        read_file(f, f_off, f_len, (char*)m_off);
+/**
+ * @brief map a whole page table range by a 4MB page if possible
+ * @param p the process
+ * @param vaddr page aligned virtual address
+ * @param pa physical address of the first page
+ * @param n_pages number of pages from vaddr to map in this page table range
+ * @param is_rw are the pages writeable
+ * @return 0 on success, -1 if small pages must be used
+ */
+static int map_huge_range(process_t* p,
+                          va_t vaddr,
+                          pa_t pa,
+                          int n_pages,
+                          int is_rw) {
+    if (n_pages != (int)NUM_PAGE_ENTRY || (pa & (PT_SIZE - 1)) != 0) {
+        return -1;
+    }
+    int old_if = save_clear_if();
+    pde_t* pde = find_user_pde(p, p->cr3, vaddr);
+    if (*pde != BAD_PDE) {
+        restore_if(old_if);
+        return -1;
     }
-    if (is_rw == 0) {
-        i = 0;
-        pa_t pt_pa = find_or_create_pt(p, m_start);
+    /* the entry was not present, so there is nothing to invalidate */
+    *pde = make_large_pde(pa, 0, PTE_USER, (is_rw ? PTE_RW : PTE_RO),
+                          PTE_PRESENT);
+    restore_if(old_if);
+    return 0;
+}
+
+int map_user_range(process_t* p, va_t vaddr, pa_t pa, int n_pages, int is_rw) {
+    va_t start = vaddr;
+    int total = n_pages, replaced = 0;
+    while (n_pages > 0) {
+        int i, n = range_chunk(vaddr, n_pages);
+        if (map_huge_range(p, vaddr, pa, n, is_rw) == 0) {
+            vaddr += n * PAGE_SIZE;
+            pa += n * PAGE_SIZE;
+            n_pages -= n;
+            continue;
+        }
+        pa_t pt_pa = find_or_create_pt(p, vaddr);
         if (pt_pa == BAD_PA) {
             goto add_pt_fail;
         }
-        do {
-            offset = i * PAGE_SIZE;
-            int pt_index = get_pt_index(m_start + offset);
-            if (pt_index == 0) {
-                /* step to next page table */
-                pt_pa = find_or_create_pt(p, m_start + offset);
-                if (pt_pa == BAD_PA) {
-                    goto add_pt_fail;
-                }
+        int first = get_pt_index(vaddr), added = 0;
+        int old_if = save_clear_if();
+        page_table_t* pt = map_user_pt(p, p->cr3, vaddr, pt_pa);
+        for (i = 0; i < n; i++) {
+            if ((*pt)[first + i] != BAD_PTE) {
+                replaced = 1;
+            } else {
+                added++;
             }
-
-            int old_if = save_clear_if();
-            page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
-            pte_t* pte = &(*pt)[pt_index];
-            *pte = ((*pte) & (~(PTE_RW << PTE_RW_SHIFT)));
-            restore_if(old_if);
-            invlpg(m_start + offset);
-        } while (++i < n_pages);
+            (*pt)[first + i] =
+                make_pte(pa + i * PAGE_SIZE, 0, PTE_USER,
+                         (is_rw ? PTE_RW : PTE_RO), PTE_PRESENT);
+        }
+        restore_if(old_if);
+        adjust_pt_entries(pt_pa, added);
+        vaddr += n * PAGE_SIZE;
+        pa += n * PAGE_SIZE;
+        n_pages -= n;
+    }
+    /* entries that were not present can not be cached in TLB */
+    if (replaced) {
+        tlb_shootdown(p->cr3, start, total);
     }
     return 0;
 
 add_pt_fail:
-    /* page tables are reachable from page directory so no need to free them */
-    vector_pop(&p->regions);
-add_region_fail:
-    free_user_pages(paddr, n_pages);
-alloc_segment_fail:
+    if (replaced) {
+        tlb_shootdown(p->cr3, start, total);
+    }
     return -1;
 }
 
-pa_t find_or_create_pt(process_t* p, va_t vaddr) {
-    int old_if = save_clear_if();
-    page_directory_t* pd = (page_directory_t*)map_phys_page(p->cr3, NULL);
-    pde_t* pde = &(*pd)[get_pd_index(vaddr)];
-    if (*pde == BAD_PDE) {
-        /* add a page table */
-        pa_t pt = alloc_user_pages(1);
-        if (pt == 0) {
-            return 0;
+void unmap_user_range(process_t* p, pa_t cr3, va_t vaddr, int n_pages) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, cr3);
+    while (n_pages > 0) {
+        int i = 0, n = range_chunk(vaddr, n_pages);
+        int first = get_pt_index(vaddr);
+        if (unmap_huge_page(p, vaddr, &batch) == 0) {
+            /* huge pages only back whole page table ranges of a region */
+            i = n;
+        } else if (n == NUM_PAGE_ENTRY &&
+                   detach_user_pt(p, vaddr, &batch) == 0) {
+            /* a large range flushes once per TLB_BATCH_TABLES page tables
+             * instead of once per TLB_BATCH_PAGES pages
+             */
+            i = n;
         }
-        va_t pt_addr = map_phys_page(pt, NULL);
-        memset((void*)pt_addr, 0, PAGE_SIZE);
+        while (i < n) {
+            int count = 0;
+            pa_t pt_pa;
+            int old_if = save_clear_if();
+            page_table_t* pt = find_user_pt(p, cr3, vaddr, &pt_pa);
+            if (pt == NULL) {
+                /* nothing was mapped in this page table */
+                restore_if(old_if);
+                break;
+            }
+            for (; i < n && !tlb_batch_full(&batch); i++) {
+                pte_t* pte = &(*pt)[first + i];
+                if (*pte != BAD_PTE) {
+                    tlb_batch_add(&batch, vaddr + i * PAGE_SIZE,
+                                  get_page_base(*pte));
+                    *pte = BAD_PTE;
+                    count++;
+                }
+            }
+            restore_if(old_if);
+            if (adjust_pt_entries(pt_pa, -count) == 0) {
+                /* the rest of page table is empty as well */
+                free_user_pt(p, vaddr, pt_pa, &batch);
+                break;
+            }
+            if (tlb_batch_full(&batch)) {
+                tlb_batch_flush(&batch);
+            }
+        }
+        vaddr += n * PAGE_SIZE;
+        n_pages -= n;
+    }
+    /* pages are released only after no CPU can reach them */
+    tlb_batch_flush(&batch);
+}
 
-        map_phys_page(p->cr3, NULL);
-        *pde = make_pde(pt, PTE_USER, PTE_RW, PTE_PRESENT);
-        invlpg(vaddr);
+void protect_user_range(process_t* p, va_t vaddr, int n_pages) {
+    va_t start = vaddr;
+    int total = n_pages, changed = 0;
+    while (n_pages > 0) {
+        int i, n = range_chunk(vaddr, n_pages);
+        int first = get_pt_index(vaddr);
+        int old_if = save_clear_if();
+        pde_t* pde = find_user_pde(p, p->cr3, vaddr);
+        if (is_large_pde(*pde) && (*pde & (PTE_RW << PTE_RW_SHIFT)) != 0) {
+            *pde = ((*pde & (~(PTE_RW << PTE_RW_SHIFT))) |
+                    (PTE_COW << PTE_COW_SHIFT));
+            changed = 1;
+        }
+        page_table_t* pt = find_user_pt(p, p->cr3, vaddr, NULL);
+        for (i = 0; pt != NULL && i < n; i++) {
+            pte_t* pte = &(*pt)[first + i];
+            if ((*pte & (PTE_PRESENT << PTE_P_SHIFT)) != 0 &&
+                (*pte & (PTE_RW << PTE_RW_SHIFT)) != 0) {
+                *pte = ((*pte & (~(PTE_RW << PTE_RW_SHIFT))) |
+                        (PTE_COW << PTE_COW_SHIFT));
+                changed = 1;
+            }
+        }
         restore_if(old_if);
-        return pt;
+        vaddr += n * PAGE_SIZE;
+        n_pages -= n;
+    }
+    if (changed) {
+        tlb_shootdown(p->cr3, start, total);
     }
-    pa_t result = get_page_table(*pde);
-    restore_if(old_if);
-    return result;
 }
 
-int add_region(process_t* p, va_t start, int n_pages, pa_t pa, int is_rw) {
+int copy_user_range(process_t* dst, process_t* src, va_t vaddr, int n_pages) {
+    while (n_pages > 0) {
+        int i, n = range_chunk(vaddr, n_pages);
+        int first = get_pt_index(vaddr);
+        int old_if = save_clear_if();
+        pde_t src_pde = *find_user_pde(src, src->cr3, vaddr);
+        int has_pt = (find_user_pt(src, src->cr3, vaddr, NULL) != NULL);
+        restore_if(old_if);
+        if (is_large_pde(src_pde)) {
+            /* share the huge page, it is copied as a whole on first write */
+            old_if = save_clear_if();
+            *find_user_pde(dst, dst->cr3, vaddr) = src_pde;
+            restore_if(old_if);
+            get_user_page(get_large_page_base(src_pde));
+        } else if (has_pt) {
+            pa_t dst_pt_pa = find_or_create_pt(dst, vaddr);
+            if (dst_pt_pa == BAD_PA) {
+                return -1;
+            }
+            /* both page tables stay mapped as the later mapping never evicts
+             * the former one
+             */
+            old_if = save_clear_if();
+            page_table_t* src_pt = find_user_pt(src, src->cr3, vaddr, NULL);
+            page_table_t* dst_pt = map_user_pt(dst, dst->cr3, vaddr, dst_pt_pa);
+            int copied = 0;
+            for (i = 0; i < n; i++) {
+                /* pages never touched stay ZFOD in both processes */
+                pte_t pte = (*src_pt)[first + i];
+                (*dst_pt)[first + i] = pte;
+                if (pte != BAD_PTE) {
+                    get_user_page(get_page_base(pte));
+                    copied++;
+                }
+            }
+            restore_if(old_if);
+            adjust_pt_entries(dst_pt_pa, copied);
+        }
+        vaddr += n * PAGE_SIZE;
+        n_pages -= n;
+    }
+    return 0;
+}
+
+int add_region(process_t* p, va_t start, int n_pages, int is_rw) {
+    return add_file_region(p, start, n_pages, is_rw, NULL);
+}
+
+int add_file_region(process_t* p,
+                    va_t start,
+                    int n_pages,
+                    int is_rw,
+                    const file_map_t* file) {
     if (start > DEFAULT_STACK_END || start < USER_MEM_START) {
         return -1;
     }
     va_t end = start + n_pages * PAGE_SIZE;
-    if (end < start) {
+    if (end < start || end > USER_MEM_END) {
         return -1;
     }
-    int i, n = vector_size(&p->regions);
-    for (i = 0; i < n; i++) {
-        /* check overlapping */
-        region_t* r = (region_t*)vector_at(&p->regions, i);
-        va_t this_start = r->addr;
-        va_t this_end = this_start + r->size;
-        if (start >= this_start && start < this_end) {
+    /* regions never overlap, so only the neighbours of start can overlap
+     * with the new one
+     */
+    rb_t* prev = rb_floor(p->regions, start / PAGE_SIZE);
+    if (prev != &rb_nil) {
+        region_t* r = rb_data(prev, region_t, node);
+        if (start - r->addr < r->size) {
             return -1;
         }
-        if (end > this_start && end <= this_end) {
+    }
+    rb_t* next = rb_ceil(p->regions, start / PAGE_SIZE);
+    if (next != &rb_nil) {
+        region_t* r = rb_data(next, region_t, node);
+        if (r->addr < end) {
             return -1;
         }
-        if (this_start >= start && this_start < end) {
-            return -1;
+    }
+    region_t* newr = smalloc(sizeof(region_t));
+    if (newr == NULL) {
+        return -1;
+    }
+    newr->node.key = start / PAGE_SIZE;
+    newr->addr = start;
+    newr->base = start;
+    newr->size = n_pages * PAGE_SIZE;
+    newr->is_rw = is_rw;
+    newr->is_huge = 0;
+    newr->grow_limit = 0;
+    if (file != NULL) {
+        newr->file = *file;
+    } else {
+        newr->file.f = NULL;
+    }
+    rb_insert(&p->regions, &newr->node);
+    return 0;
+}
+
+region_t* find_region(process_t* p, va_t addr) {
+    rb_t* node = rb_floor(p->regions, addr / PAGE_SIZE);
+    if (node == &rb_nil) {
+        return NULL;
+    }
+    region_t* r = rb_data(node, region_t, node);
+    return (addr - r->addr < r->size ? r : NULL);
+}
+
+region_t* grow_region(process_t* p, va_t addr) {
+    rb_t* node = rb_ceil(p->regions, addr / PAGE_SIZE);
+    if (node == &rb_nil) {
+        return NULL;
+    }
+    region_t* r = rb_data(node, region_t, node);
+    if (r->grow_limit == 0 || addr < r->grow_limit) {
+        return NULL;
+    }
+    va_t start = (addr & (~(STACK_GROW_PAGES * PAGE_SIZE - 1)));
+    if (start < r->grow_limit) {
+        start = r->grow_limit;
+    }
+    /* addr is not in any region, so the region below ends before addr */
+    rb_t* prev = rb_floor(p->regions, addr / PAGE_SIZE);
+    if (prev != &rb_nil) {
+        region_t* prev_r = rb_data(prev, region_t, node);
+        if (start < prev_r->addr + prev_r->size) {
+            start = prev_r->addr + prev_r->size;
         }
-        if (this_end > start && this_end <= end) {
-            return -1;
+    }
+    /* the tree is keyed by start address */
+    rb_delete(&p->regions, &r->node);
+    r->size += r->addr - start;
+    r->addr = start;
+    r->node.key = start / PAGE_SIZE;
+    rb_insert(&p->regions, &r->node);
+    return r;
+}
+
+void remove_region(process_t* p, pa_t cr3, region_t* r) {
+    release_region(p, cr3, r);
+    rb_delete(&p->regions, &r->node);
+    sfree(r, sizeof(region_t));
+}
+
+void remove_all_regions(process_t* p, pa_t cr3) {
+    while (p->regions != &rb_nil) {
+        remove_region(p, cr3, rb_data(p->regions, region_t, node));
+    }
+}
+
+/**
+ * @brief get CPUs which have registered their run queues
+ * @return mask of the CPUs
+ */
+static int online_cpus() {
+    int i, mask = 0;
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (run_queues[i] != NULL) {
+            mask |= (1 << i);
         }
     }
-    region_t newr;
-    newr.addr = start;
-    newr.size = n_pages * PAGE_SIZE;
-    newr.paddr = pa;
-    newr.is_rw = is_rw;
-    return vector_push(&p->regions, &newr);
+    return mask;
 }
 
-thread_t* select_next() {
-    thread_t* t;
-    if (ready != NULL) {
-        t = queue_data(queue_remove_head(&ready), thread_t, sched_link);
+/**
+ * @brief get CPUs a thread may run on
+ * @param t the thread
+ * @return mask of the CPUs
+ */
+static int allowed_cpus(thread_t* t) {
+    int mask = (t->affinity & online_cpus());
+    /* the general pool stays off reserved CPUs */
+    if ((mask & (~reserved_cpus)) != 0) {
+        mask &= (~reserved_cpus);
+    }
+    return mask;
+}
+
+int cpu_allowed(thread_t* t, int cpu) {
+    return ((allowed_cpus(t) & (1 << cpu)) != 0);
+}
+
+/**
+ * @brief choose the CPU a thread joins when made ready, the CPU it last ran
+ * on is kept if allowed and not busy, otherwise an idle allowed CPU runs it at
+ * once, otherwise the allowed CPU with fewest ready threads
+ * @param t the thread
+ * @return the CPU
+ */
+static int choose_cpu(thread_t* t) {
+    int mask = allowed_cpus(t);
+    if (mask == 0) {
+        return t->cpu;
+    }
+    int last_allowed = ((mask & (1 << t->cpu)) != 0);
+    if (last_allowed && run_queues[t->cpu]->idle) {
+        return t->cpu;
+    }
+    int i, best = -1;
+    for (i = 0; i < MAX_CPUS; i++) {
+        if ((mask & (1 << i)) != 0 && run_queues[i]->idle &&
+            run_queues[i]->ready == NULL) {
+            return i;
+        }
+    }
+    if (last_allowed) {
+        return t->cpu;
+    }
+    for (i = 0; i < MAX_CPUS; i++) {
+        if ((mask & (1 << i)) != 0 &&
+            (best < 0 || run_queues[i]->n_ready < run_queues[best]->n_ready)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief insert a thread to a run queue, the run queue must be locked
+ * @param rq the run queue
+ * @param t the thread
+ * @param at_head insert to the head instead of the tail
+ */
+static void rq_insert(run_queue_t* rq, thread_t* t, int at_head) {
+    t->status = THREAD_READY;
+    if (at_head) {
+        queue_insert_head(&rq->ready, &t->sched_link);
     } else {
-        t = get_idle();
+        queue_insert_tail(&rq->ready, &t->sched_link);
+    }
+    rq->n_ready++;
+}
+
+/**
+ * @brief wake up a CPU halting in its idle thread after a thread is made ready
+ * for it
+ * @param cpu the CPU
+ */
+static void kick_cpu(int cpu) {
+    int old_if = save_clear_if();
+    /* pairs with the fence in the idle loop, either this CPU sees idle set or
+     * the idle CPU sees the thread in its run queue
+     */
+    mfence();
+    if (cpu != smp_get_cpu() && run_queues[cpu]->idle) {
+        apic_ipi_cpu(cpu, RESCHED_IDT_ENTRY);
+    }
+    restore_if(old_if);
+}
+
+/**
+ * @brief wake up an idle CPU a thread may run on, so it steals the thread
+ * instead of letting it wait behind the busy CPU it was queued on
+ * @param t the thread
+ * @param busy the CPU the thread is queued on
+ */
+static void kick_idle_cpu(thread_t* t, int busy) {
+    int mask = allowed_cpus(t);
+    int cpu;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu != busy && (mask & (1 << cpu)) != 0 &&
+            run_queues[cpu] != NULL && run_queues[cpu]->idle) {
+            kick_cpu(cpu);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief lock the run queue a thread is in or joins next, the thread may be
+ * stolen by other CPUs until its run queue is locked
+ * @param t the thread
+ * @return old interrupt flag
+ */
+static int lock_thread_rq(thread_t* t) {
+    while (1) {
+        int cpu = t->cpu;
+        int old_if = spl_lock(&run_queues[cpu]->lock);
+        if (t->cpu == cpu) {
+            return old_if;
+        }
+        spl_unlock(&run_queues[cpu]->lock, old_if);
+    }
+}
+
+/**
+ * @brief take a thread out of a run queue and mark it running, the run queue
+ * must be locked
+ * @param rq the run queue
+ * @param node sched_link of the thread
+ * @return the thread
+ */
+static thread_t* rq_take(run_queue_t* rq, queue_t* node) {
+    queue_detach(&rq->ready, node);
+    rq->n_ready--;
+    thread_t* t = queue_data(node, thread_t, sched_link);
+    /* nobody else may yield to it once it leaves the queue */
+    t->status = THREAD_RUNNING;
+    return t;
+}
+
+/**
+ * @brief steal the last thread of the busiest run queue, busy queues are
+ * skipped instead of waited for, so it is safe to hold another run queue lock,
+ * a skipped queue is recorded in steal_missed of the run queue of self, which
+ * must be locked
+ * @param self current CPU
+ * @return the stolen thread or NULL if there is nothing to steal
+ */
+static thread_t* steal_thread(int self) {
+    int cpu, victim = -1, most = 0;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu != self && run_queues[cpu] != NULL &&
+            run_queues[cpu]->n_ready > most) {
+            victim = cpu;
+            most = run_queues[cpu]->n_ready;
+        }
+    }
+    run_queues[self]->steal_missed = 0;
+    if (victim < 0) {
+        return NULL;
+    }
+    run_queue_t* rq = run_queues[victim];
+    int old_if = save_clear_if();
+    if (spl_trylock(&rq->lock) == 0) {
+        restore_if(old_if);
+        /* the idle loop tries again instead of halting */
+        run_queues[self]->steal_missed = 1;
+        return NULL;
+    }
+    thread_t* t = NULL;
+    int i;
+    /* the tail is the least likely to have cache on the victim */
+    queue_t* node = (rq->ready != NULL ? rq->ready->prev : NULL);
+    for (i = 0; i < rq->n_ready; i++, node = node->prev) {
+        thread_t* candidate = queue_data(node, thread_t, sched_link);
+        if (cpu_allowed(candidate, self)) {
+            t = rq_take(rq, node);
+            t->cpu = self;
+            break;
+        }
+    }
+    spl_unlock(&rq->lock, old_if);
+    return t;
+}
+
+/**
+ * @brief select next thread of a run queue, the run queue must be locked
+ * @param rq the run queue of current CPU
+ * @return the thread or idle thread if there is none
+ */
+static thread_t* rq_select(run_queue_t* rq) {
+    if (rq->ready == NULL) {
+        thread_t* t = steal_thread(smp_get_cpu());
+        return (t != NULL ? t : get_idle());
+    }
+    thread_t* current = get_current();
+    queue_t* node = rq->ready;
+    if (rq->same_as_streak < SAME_AS_MAX_STREAK) {
+        /* switching within an address space keeps the TLB entries */
+        queue_t* q = rq->ready;
+        int i;
+        for (i = 0; i < SAME_AS_WINDOW; i++) {
+            thread_t* t = queue_data(q, thread_t, sched_link);
+            if (t != current && t->process->cr3 == current->process->cr3) {
+                node = q;
+                break;
+            }
+            q = q->next;
+            if (q == rq->ready) {
+                break;
+            }
+        }
     }
+    rq->same_as_streak = (node == rq->ready ? 0 : rq->same_as_streak + 1);
+    return rq_take(rq, node);
+}
+
+thread_t* select_next() {
+    run_queue_t* rq = &get_percpu()->rq;
+    int old_if = spl_lock(&rq->lock);
+    thread_t* t = rq_select(rq);
+    spl_unlock(&rq->lock, old_if);
     return t;
 }
 
+thr_stat_t take_ready(thread_t* t) {
+    int old_if = lock_thread_rq(t);
+    run_queue_t* rq = run_queues[t->cpu];
+    thr_stat_t status = t->status;
+    if (status == THREAD_READY) {
+        rq_take(rq, &t->sched_link);
+        t->cpu = smp_get_cpu();
+    }
+    spl_unlock(&rq->lock, old_if);
+    return status;
+}
+
+void yield_current(thread_t* t) {
+    int old_if = save_clear_if();
+    thread_t* current = get_current();
+    if (current != get_idle() && !cpu_allowed(current, smp_get_cpu())) {
+        if (t == NULL) {
+            t = select_next();
+        }
+        /* leave for an allowed CPU, whose run queue stays locked until
+         * current is saved
+         */
+        int cpu = choose_cpu(current);
+        current->cpu = cpu;
+        run_queue_t* rq = run_queues[cpu];
+        spl_lock(&rq->lock);
+        rq_insert(rq, current, 0);
+        /* the CPU picks current up once the lock is released */
+        kick_cpu(cpu);
+        yield_to_spl_unlock(t, &rq->lock, old_if);
+        return;
+    }
+    run_queue_t* rq = &get_percpu()->rq;
+    spl_lock(&rq->lock);
+    if (current != get_idle()) {
+        rq_insert(rq, current, 0);
+    }
+    if (t == NULL) {
+        t = rq_select(rq);
+    }
+    /* current can not be stolen before it is saved, as rq is locked until
+     * then
+     */
+    yield_to_spl_unlock(t, &rq->lock, old_if);
+}
+
 void insert_ready_tail(thread_t* t) {
-    t->status = THREAD_READY;
-    queue_insert_tail(&ready, &t->sched_link);
+    /* t is in no queue, so nobody else moves it */
+    int cpu = choose_cpu(t);
+    t->cpu = cpu;
+    int old_if = lock_thread_rq(t);
+    run_queue_t* rq = run_queues[cpu];
+    rq_insert(rq, t, 0);
+    int busy = !rq->idle;
+    spl_unlock(&rq->lock, old_if);
+    kick_cpu(cpu);
+    if (busy) {
+        kick_idle_cpu(t, cpu);
+    }
 }
 
 void insert_ready_head(thread_t* t) {
-    t->status = THREAD_READY;
-    queue_insert_head(&ready, &t->sched_link);
+    int cpu = choose_cpu(t);
+    t->cpu = cpu;
+    int old_if = lock_thread_rq(t);
+    run_queue_t* rq = run_queues[cpu];
+    rq_insert(rq, t, 1);
+    int busy = !rq->idle;
+    spl_unlock(&rq->lock, old_if);
+    kick_cpu(cpu);
+    if (busy) {
+        kick_idle_cpu(t, cpu);
+    }
+}
+
+void resched_handler_real() {
+    apic_eoi();
+    /* a busy CPU picks the thread up on its next tick */
+    if (get_current() == get_idle()) {
+        yield_current(NULL);
+    }
+}
+
+int set_affinity(thread_t* t, int mask) {
+    if ((mask & online_cpus()) == 0) {
+        return -1;
+    }
+    t->affinity = mask;
+    if (take_ready(t) == THREAD_READY) {
+        /* requeue on a CPU it is allowed to use */
+        insert_ready_tail(t);
+    }
+    return 0;
+}
+
+int reserve_cpus(int mask) {
+    if ((online_cpus() & (~mask)) == 0) {
+        return -1;
+    }
+    reserved_cpus = mask;
+    /* move threads of the general pool off the reserved CPUs, so they do not
+     * get another quantum there
+     */
+    int cpu;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if ((mask & (1 << cpu)) == 0 || run_queues[cpu] == NULL) {
+            continue;
+        }
+        run_queue_t* rq = run_queues[cpu];
+        queue_t* moved = NULL;
+        int old_if = spl_lock(&rq->lock);
+        queue_t* node = rq->ready;
+        int i, n = rq->n_ready;
+        for (i = 0; i < n; i++) {
+            queue_t* next = node->next;
+            thread_t* t = queue_data(node, thread_t, sched_link);
+            if (!cpu_allowed(t, cpu)) {
+                rq_take(rq, node);
+                queue_insert_tail(&moved, &t->sched_link);
+            }
+            node = next;
+        }
+        spl_unlock(&rq->lock, old_if);
+        while (moved != NULL) {
+            queue_t* q = queue_remove_head(&moved);
+            insert_ready_tail(queue_data(q, thread_t, sched_link));
+        }
+    }
+    return 0;
 }
 
 reg_t save_and_setup_env(thread_t* t, reg_t esp) {
+    percpu_t* percpu = get_percpu();
     get_current()->kernel_esp = esp;
     set_current(t);
     t->status = THREAD_RUNNING;
+    /* the thread returns to the run queue of the CPU it last ran on */
+    t->cpu = smp_get_cpu();
+    percpu->rq.idle = (t == get_idle());
+    timer_rearm(t == get_idle());
     set_esp0(t->esp0);
-    set_cr3(t->process->cr3);
+    /* CPUs running the address space get TLB shootdowns, so its entries
+     * cached here are never stale
+     */
+    if (t->process->cr3 != (pa_t)get_cr3()) {
+        load_cr3(t->process->cr3);
+        percpu->cr3_reloads++;
+    } else {
+        percpu->cr3_reloads_skipped++;
+    }
     return t->kernel_esp;
 }
 
+void get_cr3_stats(int* reloads, int* skipped) {
+    *reloads = *skipped = 0;
+    int cpu;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (percpus[cpu] != NULL) {
+            *reloads += percpus[cpu]->cr3_reloads;
+            *skipped += percpus[cpu]->cr3_reloads_skipped;
+        }
+    }
+}
+
 void swap_process_inplace(thread_t* newt) {
     disable_interrupts();
     thread_t* oldt = get_current();
     process_t* oldp = oldt->process;
     process_t* newp = newt->process;
     pa_t cr3 = oldp->cr3;
-    vector_t regions = oldp->regions;
+    rb_t* regions = oldp->regions;
     queue_t* p_threads = oldp->threads;
     pts_t* pts = oldt->pts;
     pv_t* pv = oldp->pv;
@@ -615,7 +1339,7 @@ void swap_process_inplace(thread_t* newt) {
     oldt->pts = newt->pts;
     newt->process = oldp;
     newt->pts = pts;
-    set_cr3(newp->cr3);
+    load_cr3(newp->cr3);
     mutex_lock(&threads_lock);
     /* move oldt's rbtree node to newt */
     newt->rb_node = oldt->rb_node;
@@ -670,9 +1394,7 @@ void kill_current() {
                 panic("no space to allocate init process");
             }
             swap_process_inplace(new_init);
-            int old_if = spl_lock(&ready_lock);
             insert_ready_tail(new_init);
-            spl_unlock(&ready_lock, old_if);
         }
     }
     p = current->process;
@@ -720,13 +1442,8 @@ void kill_current() {
         /* free userspace memory */
         pa_t old_cr3 = p->cr3;
         p->cr3 = (pa_t)kernel_pd;
-        set_cr3((pa_t)kernel_pd);
-        int i, n = vector_size(&p->regions);
-        for (i = 0; i < n; i++) {
-            region_t* r = (region_t*)vector_at(&p->regions, i);
-            free_user_pages(r->paddr, r->size / PAGE_SIZE);
-        }
-        vector_free(&p->regions);
+        load_cr3((pa_t)kernel_pd);
+        remove_all_regions(p, old_cr3);
         /** PV guests' page tables are managed by pv_pd_t */
         if (p->pv == NULL) {
             destroy_pd(old_cr3);
@@ -754,8 +1471,9 @@ void kill_current() {
         }
     }
     /* borrow kth's stack for freeing thread control block
-     * we can make sure kthread is not running since we are the running thread
-     * and kthread's IF is cleared so it will not be interrupted
+     * kthread only runs on this CPU and we are the running thread, so it is
+     * switched out, either in its loop or in an interrupt handler that
+     * preempted it, and it resumes there after the cleanup
      */
     thread_t* kth = get_kthread();
     set_current(kth);
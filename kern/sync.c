@@ -22,9 +22,7 @@ void mutex_lock(mutex_t* m) {
     }
     queue_insert_tail(&m->waiters, &current->sched_link);
     current->status = THREAD_BLOCKED;
-    int old_if2 = spl_lock(&ready_lock);
     thread_t* t = select_next();
-    spl_unlock(&ready_lock, old_if2);
     /* release m->gaurd last, otherwise other thread may switch to us before
      * yielding
      */
@@ -41,9 +39,7 @@ void mutex_unlock(mutex_t* m) {
     /* transfer lock ownership to t */
     thread_t* t =
         queue_data(queue_remove_head(&m->waiters), thread_t, sched_link);
-    int old_if2 = spl_lock(&ready_lock);
     insert_ready_head(t);
-    spl_unlock(&ready_lock, old_if2);
     spl_unlock(&m->guard, old_if);
 }
 
@@ -53,9 +49,7 @@ void cv_wait(cv_t* cv, mutex_t* m) {
     queue_insert_tail(&cv->waiters, &current->sched_link);
     current->status = THREAD_BLOCKED;
     mutex_unlock(m);
-    int old_if2 = spl_lock(&ready_lock);
     thread_t* t = select_next();
-    spl_unlock(&ready_lock, old_if2);
     yield_to_spl_unlock(t, &cv->guard, old_if);
     /* some threads may jump in so a condition check in a while loop is required
      * outside
@@ -71,8 +65,6 @@ void cv_signal(cv_t* cv) {
     }
     thread_t* t =
         queue_data(queue_remove_head(&cv->waiters), thread_t, sched_link);
-    int old_if2 = spl_lock(&ready_lock);
     insert_ready_head(t);
-    spl_unlock(&ready_lock, old_if2);
     spl_unlock(&cv->guard, old_if);
 }
@@ -23,72 +23,212 @@
 #include <sched.h>
 #include <usermem.h>
 
+/** @brief number of frames allocated at a time when populating a region */
+#define POPULATE_BATCH 32
+
+/**
+ * @brief read and check arguments of new_pages() family syscalls
+ * @param f saved regs
+ * @param base where to save base address
+ * @param n_pages where to save number of pages
+ * @return 0 on success, -1 on failure
+ */
+static int read_new_pages_args(stack_frame_t* f, va_t* base, int* n_pages) {
+    reg_t esi = f->esi;
+    if (copy_from_user((va_t)esi, sizeof(va_t), base) != 0) {
+        return -1;
+    }
+    if ((*base & PAGE_OFFSET_MASK) != 0) {
+        return -1;
+    }
+    int len;
+    if (copy_from_user((va_t)esi + sizeof(va_t), sizeof(int), &len) != 0) {
+        return -1;
+    }
+    if ((len & PAGE_OFFSET_MASK) != 0 || len <= 0) {
+        return -1;
+    }
+    *n_pages = len / PAGE_SIZE;
+    return 0;
+}
+
+/**
+ * @brief map zeroed pages at every page of a fresh region, pages are
+ * allocated in batches that never cross a page table so each batch costs one
+ * page table lookup
+ * @param p process, p->mm_lock must be held
+ * @param base base address of the region
+ * @param n_pages number of pages in the region
+ * @return 0 on success, -1 on failure, mapped pages are left in the region
+ */
+static int populate_pages(process_t* p, va_t base, int n_pages) {
+    pa_t pages[POPULATE_BATCH];
+    int done = 0;
+    while (done < n_pages) {
+        va_t va = base + done * PAGE_SIZE;
+        int first = get_pt_index(va);
+        int n = (int)NUM_PAGE_ENTRY - first;
+        if (n > POPULATE_BATCH) {
+            n = POPULATE_BATCH;
+        }
+        if (n > n_pages - done) {
+            n = n_pages - done;
+        }
+        pa_t pt_pa = find_or_create_pt(p, va);
+        if (pt_pa == BAD_PA) {
+            return -1;
+        }
+        if (alloc_zeroed_user_pages(pages, n) != 0) {
+            return -1;
+        }
+        /* entries were never present, so there is nothing to invalidate */
+        int i, old_if = save_clear_if();
+        page_table_t* pt = map_user_pt(p, p->cr3, va, pt_pa);
+        for (i = 0; i < n; i++) {
+            (*pt)[first + i] =
+                make_pte(pages[i], 0, PTE_USER, PTE_RW, PTE_PRESENT);
+        }
+        restore_if(old_if);
+        adjust_pt_entries(pt_pa, n);
+        done += n;
+    }
+    return 0;
+}
+
 /**
  * @brief new_pages() syscall handler
  * @param f saved regs
  */
 void sys_new_pages_real(stack_frame_t* f) {
-    reg_t esi = f->esi;
     va_t base;
-    if (copy_from_user((va_t)esi, sizeof(va_t), &base) != 0) {
+    int n_pages;
+    if (read_new_pages_args(f, &base, &n_pages) != 0) {
         goto read_fail;
     }
-    if ((base & PAGE_OFFSET_MASK) != 0) {
+
+    process_t* p = get_current()->process;
+    mutex_lock(&p->mm_lock);
+    /* pages are allocated when they are first touched */
+    if (add_region(p, base, n_pages, 1) != 0) {
+        goto add_region_fail;
+    }
+    mutex_unlock(&p->mm_lock);
+    f->eax = 0;
+    return;
+
+add_region_fail:
+    mutex_unlock(&p->mm_lock);
+read_fail:
+    f->eax = (reg_t)-1;
+}
+
+/**
+ * @brief new_pages_populate() syscall handler, same as new_pages() but every
+ * page is present and zeroed on return
+ * @param f saved regs
+ */
+void sys_new_pages_populate_real(stack_frame_t* f) {
+    va_t base;
+    int n_pages;
+    if (read_new_pages_args(f, &base, &n_pages) != 0) {
         goto read_fail;
     }
-    int len;
-    if (copy_from_user((va_t)esi + sizeof(va_t), sizeof(int), &len) != 0) {
+
+    process_t* p = get_current()->process;
+    if (p->pv != NULL) {
+        /* PV guests manage their own memory */
         goto read_fail;
     }
-    if ((len & PAGE_OFFSET_MASK) != 0) {
+    mutex_lock(&p->mm_lock);
+    if (add_region(p, base, n_pages, 1) != 0) {
+        goto add_region_fail;
+    }
+    if (populate_pages(p, base, n_pages) != 0) {
+        goto populate_fail;
+    }
+    mutex_unlock(&p->mm_lock);
+    f->eax = 0;
+    return;
+
+populate_fail:
+    remove_region(p, p->cr3, find_region(p, base));
+add_region_fail:
+    mutex_unlock(&p->mm_lock);
+read_fail:
+    f->eax = (reg_t)-1;
+}
+
+/**
+ * @brief new_pages_huge() syscall handler, same as new_pages() but 4MB aligned
+ * blocks inside the region are backed by huge pages on first touch
+ * @param f saved regs
+ */
+void sys_new_pages_huge_real(stack_frame_t* f) {
+    va_t base;
+    int n_pages;
+    if (read_new_pages_args(f, &base, &n_pages) != 0) {
         goto read_fail;
     }
 
     process_t* p = get_current()->process;
-    mutex_lock(&p->mm_lock);
-    int n_pages = len / PAGE_SIZE;
-    pa_t paddr = alloc_user_pages(n_pages);
-    if (paddr == 0) {
-        goto alloc_segment_fail;
+    if (p->pv != NULL) {
+        /* PV guests manage their own memory */
+        goto read_fail;
     }
-    if (add_region(p, base, n_pages, paddr, 1) != 0) {
+    mutex_lock(&p->mm_lock);
+    if (add_region(p, base, n_pages, 1) != 0) {
         goto add_region_fail;
     }
+    find_region(p, base)->is_huge = 1;
+    mutex_unlock(&p->mm_lock);
+    f->eax = 0;
+    return;
 
-    int i = 0;
-    int offset = 0;
-    /* file page table one entry per loop */
-    pa_t pt_pa = find_or_create_pt(p, base);
-    if (pt_pa == BAD_PA) {
-        goto add_pt_fail;
-    }
-    do {
-        offset = i * PAGE_SIZE;
-        /* step to next page table */
-        int pt_index = get_pt_index(base + offset);
-        if (pt_index == 0) {
-            pt_pa = find_or_create_pt(p, base + offset);
-            if (pt_pa == BAD_PA) {
-                goto add_pt_fail;
-            }
-        }
+add_region_fail:
+    mutex_unlock(&p->mm_lock);
+read_fail:
+    f->eax = (reg_t)-1;
+}
 
-        int old_if = save_clear_if();
-        page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
-        (*pt)[pt_index] = make_pte(paddr + offset, 0, PTE_USER, PTE_RW, 0);
-        restore_if(old_if);
-        invlpg(base + offset);
-    } while (++i < n_pages);
+/**
+ * @brief new_pages_growdown() syscall handler, same as new_pages() but the
+ * region grows down on faults below it until it covers max_len bytes
+ * @param f saved regs
+ */
+void sys_new_pages_growdown_real(stack_frame_t* f) {
+    va_t base;
+    int n_pages;
+    if (read_new_pages_args(f, &base, &n_pages) != 0) {
+        goto read_fail;
+    }
+    int max_len;
+    if (copy_from_user((va_t)f->esi + sizeof(va_t) + sizeof(int), sizeof(int),
+                       &max_len) != 0) {
+        goto read_fail;
+    }
+    if ((max_len & PAGE_OFFSET_MASK) != 0 || max_len < n_pages * PAGE_SIZE) {
+        goto read_fail;
+    }
+    va_t end = base + n_pages * PAGE_SIZE;
+    if (end < base || end - USER_MEM_START < (va_t)max_len) {
+        goto read_fail;
+    }
+
+    process_t* p = get_current()->process;
+    if (p->pv != NULL) {
+        /* PV guests manage their own memory */
+        goto read_fail;
+    }
+    mutex_lock(&p->mm_lock);
+    if (add_region(p, base, n_pages, 1) != 0) {
+        goto add_region_fail;
+    }
+    find_region(p, base)->grow_limit = end - max_len;
     mutex_unlock(&p->mm_lock);
     f->eax = 0;
     return;
 
-add_pt_fail:
-    /* page tables are reachable from page directory so no need to free them */
-    vector_pop(&p->regions);
 add_region_fail:
-    free_user_pages(paddr, n_pages);
-alloc_segment_fail:
     mutex_unlock(&p->mm_lock);
 read_fail:
     f->eax = (reg_t)-1;
@@ -102,34 +242,13 @@ void sys_remove_pages_real(stack_frame_t* f) {
     process_t* p = get_current()->process;
     mutex_lock(&p->mm_lock);
     va_t base = (va_t)f->esi;
-    int i, j, n = vector_size(&p->regions);
-    for (i = 0; i < n; i++) {
-        region_t* r = (region_t*)vector_at(&p->regions, i);
-        if (base == r->addr) {
-            int n_pages = r->size / PAGE_SIZE;
-            j = 0;
-            int offset = 0;
-            pa_t pt_pa = find_or_create_pt(p, base);
-            do {
-                offset = j * PAGE_SIZE;
-                int pt_index = get_pt_index(base + offset);
-                if (pt_index == 0) {
-                    pt_pa = find_or_create_pt(p, base + offset);
-                }
-
-                int old_if = save_clear_if();
-                page_table_t* pt = (page_table_t*)map_phys_page(pt_pa, NULL);
-                (*pt)[pt_index] = BAD_PDE;
-                restore_if(old_if);
-                invlpg(base + offset);
-            } while (++j < n_pages);
-
-            free_user_pages(r->paddr, r->size / PAGE_SIZE);
-            vector_remove(&p->regions, i);
-            mutex_unlock(&p->mm_lock);
-            f->eax = 0;
-            return;
-        }
+    region_t* r = find_region(p, base);
+    /* a grown region is removed by the address it was created at */
+    if (r != NULL && r->base == base) {
+        remove_region(p, p->cr3, r);
+        mutex_unlock(&p->mm_lock);
+        f->eax = 0;
+        return;
     }
     /* no such region */
     mutex_unlock(&p->mm_lock);
@@ -50,6 +50,20 @@ void sys_halt_real(stack_frame_t* f) {
     panic("Halted");
 }
 
+/**
+ * @brief get_cr3_stats() syscall handler
+ * @param f saved regs
+ */
+void sys_get_cr3_stats_real(stack_frame_t* f) {
+    int stats[2];
+    get_cr3_stats(&stats[0], &stats[1]);
+    if (copy_to_user((va_t)f->esi, sizeof(stats), stats) != 0) {
+        f->eax = (reg_t)-1;
+        return;
+    }
+    f->eax = 0;
+}
+
 /**
  * @brief read the "." file to user buf
  * @param buf buffer
@@ -66,11 +66,9 @@ void sys_fork_real(stack_frame_t* f) {
     }
     int tid = alloc_tid();
     t->process->pid = t->rb_node.key = tid;
-    int i, n = vector_size(&p->regions);
-    for (i = 0; i < n; i++) {
-        int result =
-            copy_region(t->process, (region_t*)vector_at(&p->regions, i));
-        if (result != 0) {
+    rb_t* node;
+    for (node = rb_min(p->regions); node != &rb_nil; node = rb_next(node)) {
+        if (copy_region(t->process, rb_data(node, region_t, node)) != 0) {
             goto copy_region_fail;
         }
     }
@@ -95,9 +93,7 @@ void sys_fork_real(stack_frame_t* f) {
     p->nchilds++;
     mutex_unlock(&p->wait_lock);
     add_thread(t);
-    int old_if = spl_lock(&ready_lock);
     insert_ready_tail(t);
-    spl_unlock(&ready_lock, old_if);
     f->eax = (reg_t)tid;
     return;
 
@@ -115,62 +111,25 @@ fork_multiple_threads:
 static int copy_region(process_t* p, region_t* src) {
     process_t* cur_p = get_current()->process;
     int n_pages = src->size / PAGE_SIZE;
-    pa_t paddr = alloc_user_pages(n_pages);
-    if (paddr == 0) {
-        goto alloc_segment_fail;
-    }
-    if (add_region(p, src->addr, n_pages, paddr, src->is_rw) != 0) {
+    if (add_file_region(p, src->addr, n_pages, src->is_rw, &src->file) != 0) {
         goto add_region_fail;
     }
-
-    int rw = (src->is_rw ? PTE_RW : PTE_RO);
-    int i = 0;
-    int offset = 0;
-    /* file page table one entry per loop */
-    pa_t dst_pt_pa = find_or_create_pt(p, src->addr);
-    if (dst_pt_pa == BAD_PA) {
+    region_t* r = find_region(p, src->addr);
+    r->is_huge = src->is_huge;
+    r->base = src->base;
+    r->grow_limit = src->grow_limit;
+    /* write protect the pages in both processes, the first write will copy
+     * them
+     */
+    protect_user_range(cur_p, src->addr, n_pages);
+    if (copy_user_range(p, cur_p, src->addr, n_pages) != 0) {
         goto add_pt_fail;
     }
-    pa_t src_pt_pa = find_or_create_pt(cur_p, src->addr);
-    do {
-        offset = i * PAGE_SIZE;
-        /* step to next page table */
-        int pt_index = get_pt_index(src->addr + offset);
-        if (pt_index == 0) {
-            dst_pt_pa = find_or_create_pt(p, src->addr + offset);
-            if (dst_pt_pa == BAD_PA) {
-                goto add_pt_fail;
-            }
-            src_pt_pa = find_or_create_pt(cur_p, src->addr);
-        }
-
-        int old_if = save_clear_if();
-        /* check if source page is never accessed */
-        page_table_t* src_pt = (page_table_t*)map_phys_page(src_pt_pa, NULL);
-        if (((*src_pt)[pt_index] & (PTE_PRESENT << PTE_P_SHIFT)) != 0) {
-            /* need to copy non zero page */
-            page_table_t* dst_pt =
-                (page_table_t*)map_phys_page(dst_pt_pa, NULL);
-            (*dst_pt)[pt_index] =
-                make_pte(paddr + offset, 0, PTE_USER, rw, PTE_PRESENT);
-            char* page = (char*)map_phys_page(paddr + offset, NULL);
-            memcpy(page, (char*)(src->addr + offset), PAGE_SIZE);
-        } else {
-            /* source page is waiting for ZFOD, so dest page will also ZFOD */
-            page_table_t* dst_pt =
-                (page_table_t*)map_phys_page(dst_pt_pa, NULL);
-            (*dst_pt)[pt_index] = make_pte(paddr + offset, 0, PTE_USER, rw, 0);
-        }
-        restore_if(old_if);
-    } while (++i < n_pages);
     return 0;
 
 add_pt_fail:
-    /* page tables are reachable from page directory so no need to free them */
-    vector_pop(&p->regions);
+    /* the pages shared so far are released when p is destroyed */
 add_region_fail:
-    free_user_pages(paddr, n_pages);
-alloc_segment_fail:
     return -1;
 }
 
@@ -194,9 +153,7 @@ void sys_task_vanish_real(stack_frame_t* f) {
         int old_if = spl_lock(&t->status_lock);
         /* wakeup descheduled threads */
         if (t->status == THREAD_DESCHEDULED) {
-            int old_if2 = spl_lock(&ready_lock);
             insert_ready_tail(t);
-            spl_unlock(&ready_lock, old_if2);
         }
         spl_unlock(&t->status_lock, old_if);
         node = node->next;
@@ -281,9 +238,7 @@ void sys_exec_real(stack_frame_t* f) {
     sfree(argv_buf, argc * sizeof(char*));
     free(exe);
     swap_process_inplace(t);
-    int old_if = spl_lock(&ready_lock);
     insert_ready_tail(t);
-    spl_unlock(&ready_lock, old_if);
     kill_current();
 
 create_process_fail:
@@ -368,21 +323,7 @@ void sys_sleep_real(stack_frame_t* f) {
         f->eax = (reg_t)dt;
         return;
     }
-    thread_t* current = get_current();
-    heap_node_t node;
-    node.key = ticks + dt;
-    node.value = (void*)current;
-    int old_if = spl_lock(&timer_lock);
-    if (heap_insert(&timers, &node) != 0) {
-        spl_unlock(&timer_lock, old_if);
-        f->eax = (reg_t)-2;
-        return;
-    }
-    int old_if2 = spl_lock(&ready_lock);
-    current->status = THREAD_SLEEPING;
-    thread_t* t = select_next();
-    spl_unlock(&ready_lock, old_if2);
-    yield_to_spl_unlock(t, &timer_lock, old_if);
+    sleep_until(timer_ticks() + dt);
     f->eax = 0;
     return;
 }
@@ -392,6 +333,6 @@ void sys_sleep_real(stack_frame_t* f) {
  * @param f saved regs
  */
 void sys_get_ticks_real(stack_frame_t* f) {
-    f->eax = (reg_t)ticks;
+    f->eax = (reg_t)timer_ticks();
     return;
 }
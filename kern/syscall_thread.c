@@ -45,6 +45,8 @@ void sys_thread_fork_real(stack_frame_t* f) {
     t->rb_node.key = tid;
     t->status = THREAD_DEAD;
     t->status_lock = SPL_INIT;
+    t->cpu = current->cpu;
+    t->affinity = current->affinity;
     t->pending_exit = current->pending_exit;
     t->esp3 = current->esp3;
     t->eip3 = current->eip3;
@@ -73,9 +75,7 @@ void sys_thread_fork_real(stack_frame_t* f) {
     queue_insert_tail(&p->threads, &t->process_link);
     mutex_unlock(&p->refcount_lock);
     add_thread(t);
-    int old_if = spl_lock(&ready_lock);
     insert_ready_tail(t);
-    spl_unlock(&ready_lock, old_if);
     f->eax = (reg_t)tid;
     return;
 
@@ -104,10 +104,8 @@ void sys_deschedule_real(stack_frame_t* f) {
         f->eax = (reg_t)0;
         return;
     }
-    int old_if2 = spl_lock(&ready_lock);
     current->status = THREAD_DESCHEDULED;
     thread_t* t = select_next();
-    spl_unlock(&ready_lock, old_if2);
     /* release status_lock last to make sure nobody make us runnable before
      * deschedule
      */
@@ -140,13 +138,10 @@ void sys_make_runnable_real(stack_frame_t* f) {
         return;
     }
     mutex_unlock(&threads_lock);
-    /* must lock ready lock before setting status to READY otherwise yield() may
-     * yield to it before we insert it into ready queue
+    /* status is set to READY under the run queue lock, so yield() can not
+     * yield to it before it is in the run queue
      */
-    int old_if2 = spl_lock(&ready_lock);
-    t->status = THREAD_READY;
     insert_ready_tail(t);
-    spl_unlock(&ready_lock, old_if2);
     spl_unlock(&t->status_lock, old_if);
     f->eax = (reg_t)0;
     return;
@@ -167,10 +162,7 @@ void sys_vanish_real(stack_frame_t* f) {
 void sys_yield_real(stack_frame_t* f) {
     int tid = (int)f->esi;
     if (tid == -1) {
-        int old_if = spl_lock(&ready_lock);
-        insert_ready_tail(get_current());
-        thread_t* t = select_next();
-        yield_to_spl_unlock(t, &ready_lock, old_if);
+        yield_current(NULL);
         f->eax = (reg_t)0;
         return;
     }
@@ -181,33 +173,81 @@ void sys_yield_real(stack_frame_t* f) {
         f->eax = (reg_t)-2;
         return;
     }
-    /* we must hold threads_lock and ready_lock before making sure t is ready
-     * if we do not have threads_lock, t may be freed
-     * if we do not have ready_lock, t may be turned from ready to running by
-     * other processors
+    /* we must hold threads_lock before making sure t is ready, otherwise t
+     * may be freed, take_ready() checks it under the lock of t's run queue
+     * so t can not be turned from ready to running by other processors
      */
-    int old_if = spl_lock(&ready_lock);
-    if (t->status == THREAD_RUNNING) {
+    thr_stat_t status = take_ready(t);
+    /* if we are sure t is ready and take it from its run queue, it will not
+     * suddenly run so we can make sure t will not be freed
+     */
+    mutex_unlock(&threads_lock);
+    if (status == THREAD_RUNNING) {
         /* t is running or other processor, no need to yield */
-        t = select_next();
-    } else if (t->status == THREAD_READY) {
-        queue_detach(&ready, &t->sched_link);
-    } else {
-        spl_unlock(&ready_lock, old_if);
-        mutex_unlock(&threads_lock);
+        t = NULL;
+    } else if (status != THREAD_READY) {
         f->eax = (reg_t)-1;
         return;
     }
-    /* if we are sure t is ready and remove it from ready queue, it will not
-     * suddenly run so we can make sure t will not be freed
-     */
-    mutex_unlock(&threads_lock);
-    insert_ready_tail(get_current());
-    yield_to_spl_unlock(t, &ready_lock, old_if);
+    yield_current(t);
     f->eax = (reg_t)0;
     return;
 }
 
+/**
+ * @brief set_affinity() syscall handler
+ * @param f saved regs
+ */
+void sys_set_affinity_real(stack_frame_t* f) {
+    int args[2];
+    if (copy_from_user((va_t)f->esi, sizeof(args), args) != 0) {
+        f->eax = (reg_t)-1;
+        return;
+    }
+    thread_t* current = get_current();
+    mutex_lock(&threads_lock);
+    thread_t* t = find_thread(args[0]);
+    if (t == NULL) {
+        mutex_unlock(&threads_lock);
+        f->eax = (reg_t)-2;
+        return;
+    }
+    /* holding threads_lock keeps t from being freed */
+    int result = set_affinity(t, args[1]);
+    mutex_unlock(&threads_lock);
+    if (result == 0 && t == current &&
+        !cpu_allowed(current, current->cpu)) {
+        /* move to an allowed CPU now */
+        yield_current(NULL);
+    }
+    f->eax = (reg_t)result;
+}
+
+/**
+ * @brief get_affinity() syscall handler
+ * @param f saved regs
+ */
+void sys_get_affinity_real(stack_frame_t* f) {
+    int tid = (int)f->esi;
+    mutex_lock(&threads_lock);
+    thread_t* t = find_thread(tid);
+    if (t == NULL) {
+        mutex_unlock(&threads_lock);
+        f->eax = (reg_t)-2;
+        return;
+    }
+    f->eax = (reg_t)t->affinity;
+    mutex_unlock(&threads_lock);
+}
+
+/**
+ * @brief reserve_cpus() syscall handler
+ * @param f saved regs
+ */
+void sys_reserve_cpus_real(stack_frame_t* f) {
+    f->eax = (reg_t)reserve_cpus((int)f->esi);
+}
+
 /* eflags fields that are allowed to be changed by user */
 #define EFLAGS_USER_MASK                                                     \
     (EFL_CF | EFL_PF | EFL_AF | EFL_ZF | EFL_SF | EFL_TF | EFL_DF | EFL_OF | \
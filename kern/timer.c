@@ -17,18 +17,27 @@
 #include <x86/interrupt_defines.h>
 #include <x86/timer_defines.h>
 
+#include <asm_instr.h>
 #include <interrupt.h>
+#include <mm.h>
 #include <sched.h>
 #include <sync.h>
 #include <timer.h>
 
-unsigned int ticks = 0;
-
-spl_t timer_lock = SPL_INIT;
-
-heap_t timers;
+/** timer wheels of all CPUs */
+static timer_wheel_t wheels[MAX_CPUS];
 
+/** LAPIC timer counts per tick */
 static uint32_t lapic_dt;
+/** TSC cycles per tick */
+static uint32_t tsc_dt;
+/** TSC when ticks started */
+static uint64_t tsc_start;
+/** longest one-shot interval in ticks that LAPIC timer can count */
+static uint32_t max_oneshot_ticks;
+
+/** next of a timer wheel without timers */
+#define NO_DEADLINE 0xffffffff
 
 /* 2ms */
 #define TIMER_FREQ 500
@@ -40,8 +49,10 @@ void timer_test_handler();
 void timer_init() {
     /* use 10x slower frequency for APIC timer testing */
     int counter = TIMER_RATE / (TIMER_FREQ / 10);
-    if (heap_init(&timers) != 0) {
-        panic("no space to initialize timer heap");
+    int i;
+    for (i = 0; i < MAX_CPUS; i++) {
+        wheels[i].lock = SPL_INIT;
+        wheels[i].next = NO_DEADLINE;
     }
     idt_t* idt = (idt_t*)idt_base();
     idt_t old_idt = idt[TIMER_IDT_ENTRY];
@@ -51,6 +62,7 @@ void timer_init() {
     lapic_write(LAPIC_LVT_TIMER, (LAPIC_ONESHOT | TIMER_IDT_ENTRY));
     lapic_write(LAPIC_TIMER_DIV, LAPIC_X1);
     lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+    uint64_t tsc_begin = rdtsc();
 
     timer_count = 10;
     while (1) {
@@ -69,45 +81,222 @@ void timer_init() {
 
     /* 10 10x slow tests to calculate LAPIC frequency */
     lapic_dt = (0xffffffff - lapic_read(LAPIC_TIMER_CUR)) / 100;
+    tsc_start = rdtsc();
+    uint64_t tsc_elapsed = tsc_start - tsc_begin;
+    div64_32(&tsc_elapsed, 100);
+    tsc_dt = (uint32_t)tsc_elapsed;
+    max_oneshot_ticks = 0xffffffff / lapic_dt - 1;
     lapic_write(LAPIC_TIMER_INIT, 0);
     idt[TIMER_IDT_ENTRY] = old_idt;
 }
 
 void setup_lapic_timer() {
+#if TIMER_TICKLESS
+    lapic_write(LAPIC_LVT_TIMER, (LAPIC_ONESHOT | TIMER_IDT_ENTRY));
+#else
     lapic_write(LAPIC_LVT_TIMER, (LAPIC_PERIODIC | TIMER_IDT_ENTRY));
+#endif
     lapic_write(LAPIC_TIMER_DIV, LAPIC_X1);
     lapic_write(LAPIC_TIMER_INIT, lapic_dt);
 }
 
+unsigned int timer_ticks() {
+    uint64_t elapsed = rdtsc() - tsc_start;
+    div64_32(&elapsed, tsc_dt);
+    return (unsigned int)elapsed;
+}
+
 /**
- * @brief check expired timers
+ * @brief put a thread into the slot of a timer wheel its wakeup falls in
+ * @param w the timer wheel, must be locked
+ * @param t the thread
  */
-static void check_timers() {
-    int old_if = spl_lock(&timer_lock);
-    heap_node_t* node;
-    while ((node = heap_peak(&timers)) != NULL) {
-        if (node->key > ticks) {
-            break;
+static void wheel_place(timer_wheel_t* w, thread_t* t) {
+    uint32_t wakeup = t->wakeup;
+    if ((int)(wakeup - w->now) < 0) {
+        /* already due, process it on the next tick */
+        wakeup = w->now;
+    }
+    unsigned int delta = wakeup - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= (1u << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (level == WHEEL_LEVELS - 1 &&
+        delta >= (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1) {
+        /* too far away, park it in the furthest slot */
+        wakeup = w->now + (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    int idx = (wakeup >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    queue_insert_tail(&w->slots[level][idx], &t->timer_link);
+}
+
+/**
+ * @brief find a tick no timer of a wheel needs processing before, it is
+ * exact for timers in level 0, and the cascade tick of the first used slot for
+ * upper levels
+ * @param w the timer wheel, must be locked
+ * @return the tick, or NO_DEADLINE if the wheel is empty
+ */
+static unsigned int wheel_next(timer_wheel_t* w) {
+    if (w->count == 0) {
+        return NO_DEADLINE;
+    }
+    unsigned int next = NO_DEADLINE;
+    int level;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        unsigned int base = w->now >> shift;
+        /* a slot of current index has been cascaded, unless the clock is
+         * right at its start
+         */
+        unsigned int off = ((w->now & ((1u << shift) - 1)) == 0 ? 0 : 1);
+        unsigned int end = off + WHEEL_SIZE;
+        for (; off < end; off++) {
+            if (w->slots[level][(base + off) & (WHEEL_SIZE - 1)] != NULL) {
+                unsigned int tick = (base + off) << shift;
+                if (tick < next) {
+                    next = tick;
+                }
+                break;
+            }
         }
-        thread_t* t = (thread_t*)node->value;
-        heap_pop(&timers);
-        int old_if2 = spl_lock(&ready_lock);
-        insert_ready_tail(t);
-        spl_unlock(&ready_lock, old_if2);
     }
-    spl_unlock(&timer_lock, old_if);
+    return next;
+}
+
+/**
+ * @brief spread a slot of an upper level into lower levels
+ * @param w the timer wheel, must be locked
+ * @param level the level of the slot
+ * @return index of the slot
+ */
+static int wheel_cascade(timer_wheel_t* w, int level) {
+    int idx = (w->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+    queue_t* slot = w->slots[level][idx];
+    w->slots[level][idx] = NULL;
+    while (slot != NULL) {
+        queue_t* node = queue_remove_head(&slot);
+        wheel_place(w, queue_data(node, thread_t, timer_link));
+    }
+    return idx;
+}
+
+/**
+ * @brief process ticks of a timer wheel up to a tick, and make threads whose
+ * wakeup passed ready, ticks without a timer or cascade to process are
+ * skipped
+ * @param w the timer wheel, must be locked
+ * @param until the last tick to process
+ */
+static void wheel_advance(timer_wheel_t* w, unsigned int until) {
+    if (w->count == 0) {
+        w->now = until + 1;
+        return;
+    }
+    while ((int)(until - w->now) >= 0 && w->count != 0) {
+        int idx = w->now & (WHEEL_SIZE - 1);
+        int level = 1;
+        if (idx == 0) {
+            while (level < WHEEL_LEVELS && wheel_cascade(w, level) == 0) {
+                level++;
+            }
+        }
+        queue_t* slot = w->slots[0][idx];
+        w->slots[0][idx] = NULL;
+        while (slot != NULL) {
+            queue_t* node = queue_remove_head(&slot);
+            w->count--;
+            insert_ready_tail(queue_data(node, thread_t, timer_link));
+        }
+        w->now++;
+        if (w->count != 0) {
+            /* nothing happens before the next used slot, and the slots of
+             * the ticks in between are empty on all levels
+             */
+            unsigned int next = wheel_next(w);
+            w->now = ((int)(until - next) >= 0 ? next : until + 1);
+        }
+    }
+    if (w->count == 0) {
+        w->now = until + 1;
+    }
+    w->next = wheel_next(w);
+}
+
+void sleep_until(unsigned int wakeup) {
+    thread_t* current = get_current();
+    /* stay on this CPU so the wheel is ours and the switch below rearms the
+     * timer for it
+     */
+    int old_if = save_clear_if();
+    timer_wheel_t* w = &wheels[smp_get_cpu()];
+    spl_lock(&w->lock);
+    if (w->count == 0) {
+        /* the clock of an empty wheel may be stale */
+        w->now = timer_ticks();
+    }
+    current->wakeup = wakeup;
+    wheel_place(w, current);
+    w->count++;
+    if (wakeup < w->next) {
+        w->next = wakeup;
+    }
+    current->status = THREAD_SLEEPING;
+    thread_t* t = select_next();
+    yield_to_spl_unlock(t, &w->lock, old_if);
+}
+
+void timer_rearm(int is_idle) {
+#if TIMER_TICKLESS
+    unsigned int deadline = wheels[smp_get_cpu()].next;
+    if (is_idle && deadline == NO_DEADLINE) {
+        /* nothing to wait for, stop ticking until an IPI brings work */
+        lapic_write(LAPIC_TIMER_INIT, 0);
+        return;
+    }
+    uint64_t now = rdtsc() - tsc_start;
+    uint64_t end = (deadline == NO_DEADLINE
+                        ? now + (uint64_t)max_oneshot_ticks * tsc_dt
+                        : (uint64_t)deadline * tsc_dt);
+    if (!is_idle && end > now + (uint64_t)TIMER_QUANTUM * tsc_dt) {
+        end = now + (uint64_t)TIMER_QUANTUM * tsc_dt;
+    }
+    uint64_t left = (end > now ? end - now : 0);
+    uint32_t rem = div64_32(&left, tsc_dt);
+    if (left > max_oneshot_ticks) {
+        /* wake up early and program the rest then */
+        left = max_oneshot_ticks;
+        rem = 0;
+    }
+    /* convert TSC cycles to LAPIC counts */
+    uint64_t frac = (uint64_t)rem * lapic_dt;
+    div64_32(&frac, tsc_dt);
+    uint32_t count = (uint32_t)left * lapic_dt + (uint32_t)frac;
+    lapic_write(LAPIC_TIMER_INIT, (count != 0 ? count : 1));
+#endif
+}
+
+/**
+ * @brief wake up threads in current CPU's timer wheel whose wakeup passed
+ */
+static void check_timers() {
+    unsigned int now = timer_ticks();
+    timer_wheel_t* w = &wheels[smp_get_cpu()];
+    if (w->next > now) {
+        return;
+    }
+    int old_if = spl_lock(&w->lock);
+    wheel_advance(w, now);
+    spl_unlock(&w->lock, old_if);
 }
 
 void timer_handler_real(stack_frame_t* f) {
     apic_eoi();
-    ticks++;
     check_timers();
     pv_inject_irq(f, TIMER_IDT_ENTRY, 0);
-    int old_if = spl_lock(&ready_lock);
-    thread_t* current = get_current();
-    if (current != get_idle()) {
-        insert_ready_tail(current);
-    }
-    thread_t* t = select_next();
-    yield_to_spl_unlock(t, &ready_lock, old_if);
+    /* a new thread rearms the timer again when switched to */
+    timer_rearm(get_current() == get_idle());
+    yield_current(NULL);
 }
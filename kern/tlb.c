@@ -0,0 +1,162 @@
+/** @file tlb.c
+ *
+ *  @brief TLB management across CPUs.
+ *
+ *  @author Hanjie Wu (hanjiew)
+ *  @bug No functional bugs
+ */
+
+#include <apic.h>
+#include <mptable.h>
+#include <smp.h>
+#include <x86/cr.h>
+
+#include <asm_instr.h>
+#include <mm.h>
+#include <sync.h>
+#include <tlb.h>
+
+/** page directory loaded by each CPU */
+static volatile pa_t loaded_cr3[MAX_CPUS];
+
+/** only one shootdown is in flight at a time */
+static spl_t shootdown_lock = SPL_INIT;
+/** first page of the shootdown in flight */
+static volatile va_t shootdown_vaddr;
+/** number of pages of the shootdown in flight */
+static volatile int shootdown_n_pages;
+/** CPUs which have not flushed for the shootdown in flight */
+static volatile int shootdown_pending;
+
+/**
+ * @brief flush TLB entries of a range on current CPU
+ * @param vaddr page aligned virtual address
+ * @param n_pages number of pages, or TLB_FLUSH_ALL
+ */
+static void flush_local(va_t vaddr, int n_pages) {
+    if (n_pages == TLB_FLUSH_ALL || n_pages > TLB_FLUSH_THRESHOLD) {
+        set_cr3(get_cr3());
+        return;
+    }
+    int i;
+    for (i = 0; i < n_pages; i++) {
+        invlpg(vaddr + i * PAGE_SIZE);
+    }
+}
+
+/**
+ * @brief flush for the shootdown in flight if current CPU is a target,
+ * interrupts must be disabled
+ */
+static void serve_shootdown() {
+    int self = (1 << smp_get_cpu());
+    if ((shootdown_pending & self) == 0) {
+        return;
+    }
+    /* flushing a CPU which has switched away is harmless */
+    flush_local(shootdown_vaddr, shootdown_n_pages);
+    atomic_add((int*)&shootdown_pending, -self);
+}
+
+void load_cr3(pa_t cr3) {
+    int old_if = save_clear_if();
+    /* record first, a shootdown missing us now happens before the load */
+    loaded_cr3[smp_get_cpu()] = cr3;
+    set_cr3(cr3);
+    restore_if(old_if);
+}
+
+void tlb_shootdown(pa_t cr3, va_t vaddr, int n_pages) {
+    int old_if = save_clear_if();
+    if (cr3 == (pa_t)get_cr3()) {
+        flush_local(vaddr, n_pages);
+    }
+    /* page table changes must be visible before other CPUs are checked */
+    mfence();
+    int i, self = smp_get_cpu(), targets = 0;
+    for (i = 0; i < smp_num_cpus(); i++) {
+        if (i != self && loaded_cr3[i] == cr3) {
+            targets |= (1 << i);
+        }
+    }
+    if (targets == 0) {
+        restore_if(old_if);
+        return;
+    }
+    /* the owner of the lock may be waiting for us to flush */
+    while (spl_trylock(&shootdown_lock) == 0) {
+        serve_shootdown();
+    }
+    shootdown_vaddr = vaddr;
+    shootdown_n_pages = n_pages;
+    shootdown_pending = targets;
+    for (i = 0; i < smp_num_cpus(); i++) {
+        if ((targets & (1 << i)) != 0) {
+            apic_ipi_cpu(i, TLB_SHOOTDOWN_IDT_ENTRY);
+        }
+    }
+    while (shootdown_pending != 0) {
+        continue;
+    }
+    spl_unlock(&shootdown_lock, old_if);
+}
+
+void tlb_batch_init(tlb_batch_t* b, pa_t cr3) {
+    b->cr3 = cr3;
+    b->start = b->end = 0;
+    b->flush_all = 0;
+    b->count = 0;
+    b->n_tables = 0;
+}
+
+void tlb_batch_add(tlb_batch_t* b, va_t vaddr, pa_t pa) {
+    if (tlb_batch_full(b)) {
+        tlb_batch_flush(b);
+    }
+    if (b->start == b->end) {
+        b->start = vaddr;
+        b->end = vaddr + PAGE_SIZE;
+    } else if (vaddr < b->start) {
+        b->start = vaddr;
+    } else if (vaddr >= b->end) {
+        b->end = vaddr + PAGE_SIZE;
+    }
+    b->pages[b->count++] = pa;
+}
+
+void tlb_batch_add_pde(tlb_batch_t* b, pa_t pa) {
+    if (tlb_batch_full(b)) {
+        tlb_batch_flush(b);
+    }
+    b->flush_all = 1;
+    b->pages[b->count++] = pa;
+}
+
+void tlb_batch_add_pt(tlb_batch_t* b, pa_t pa) {
+    if (b->n_tables == TLB_BATCH_TABLES) {
+        tlb_batch_flush(b);
+    }
+    b->flush_all = 1;
+    b->tables[b->n_tables++] = pa;
+}
+
+void tlb_batch_flush(tlb_batch_t* b) {
+    if (b->flush_all) {
+        tlb_shootdown(b->cr3, 0, TLB_FLUSH_ALL);
+    } else if (b->start != b->end) {
+        tlb_shootdown(b->cr3, b->start, (b->end - b->start) / PAGE_SIZE);
+    }
+    int i;
+    for (i = 0; i < b->count; i++) {
+        put_user_page(b->pages[i]);
+    }
+    for (i = 0; i < b->n_tables; i++) {
+        put_user_pt(b->tables[i]);
+    }
+    tlb_batch_init(b, b->cr3);
+}
+
+void tlb_shootdown_handler_real() {
+    apic_eoi();
+    serve_shootdown();
+}
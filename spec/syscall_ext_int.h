@@ -0,0 +1,34 @@
+/** @file syscall_ext_int.h
+ *
+ *  @brief interrupt numbers and limits of system calls provided by this
+ *  kernel in addition to the 410 spec, shared by the kernel and user library
+ *
+ *  @author Hanjie Wu (hanjiew)
+ *  @bug No known bugs
+ */
+
+#ifndef _SYSCALL_EXT_INT_H
+#define _SYSCALL_EXT_INT_H
+
+#include <syscall_int.h>
+
+/** new_pages() variant that maps zeroed pages at allocation time */
+#define NEW_PAGES_POPULATE_INT SYSCALL_RESERVED_0
+/** new_pages() variant that backs 4MB aligned blocks by huge pages */
+#define NEW_PAGES_HUGE_INT SYSCALL_RESERVED_1
+/** set the mask of CPUs a thread is allowed to run on */
+#define SET_AFFINITY_INT SYSCALL_RESERVED_2
+/** get the mask of CPUs a thread is allowed to run on */
+#define GET_AFFINITY_INT SYSCALL_RESERVED_3
+/** keep CPUs from threads not pinned to them */
+#define RESERVE_CPUS_INT SYSCALL_RESERVED_4
+/** get the numbers of cr3 reloads done and skipped on context switches */
+#define GET_CR3_STATS_INT SYSCALL_RESERVED_5
+/** new_pages() variant that the kernel grows down on faults below it */
+#define NEW_PAGES_GROWDOWN_INT SYSCALL_RESERVED_6
+
+/** maximum size the kernel grows the initial stack of a program to, the user
+ * library keeps other thread stacks out of this area */
+#define INITIAL_STACK_LIMIT (1 << 24)
+
+#endif /* _SYSCALL_EXT_INT_H */
@@ -0,0 +1,80 @@
+/**
+ * @file syscall_ext.h
+ * @author Hanjie Wu (hanjiew)
+ * @brief system calls provided by this kernel in addition to the 410 spec
+ *
+ */
+
+#ifndef SYSCALL_EXT_H
+#define SYSCALL_EXT_H
+
+#include <syscall_ext_int.h>
+
+#ifndef ASSEMBLER
+
+/**
+ * @brief same as new_pages(), but every page is present and zeroed on return,
+ * so touching the pages later does not fault
+ * @param addr base address, must be page aligned
+ * @param len length in bytes, must be a positive multiple of page size
+ * @return 0 on success, negative on failure
+ */
+int new_pages_populate(void* addr, int len);
+
+/**
+ * @brief same as new_pages(), but each 4MB aligned block inside the region is
+ * backed by a single huge page on first touch when one is available, which
+ * saves page faults and TLB entries for large buffers
+ * @param addr base address, must be page aligned
+ * @param len length in bytes, must be a positive multiple of page size
+ * @return 0 on success, negative on failure
+ */
+int new_pages_huge(void* addr, int len);
+
+/**
+ * @brief same as new_pages(), but the kernel grows the region down on faults
+ * below it, until it covers max_len bytes ending at addr + len, or reaches the
+ * region below, remove_pages(addr) removes it with all it has grown
+ * @param addr base address, must be page aligned
+ * @param len length in bytes, must be a positive multiple of page size
+ * @param max_len size the region may grow to, a multiple of page size no
+ * less than len
+ * @return 0 on success, negative on failure
+ */
+int new_pages_growdown(void* addr, int len, int max_len);
+
+/**
+ * @brief set the mask of CPUs a thread is allowed to run on, bit i stands for
+ * CPU i, the mask is inherited by threads created by the thread
+ * @param tid the thread
+ * @param mask mask of CPUs
+ * @return 0 on success, negative on failure
+ */
+int set_affinity(int tid, int mask);
+
+/**
+ * @brief get the mask of CPUs a thread is allowed to run on
+ * @param tid the thread
+ * @return the mask on success, negative on failure
+ */
+int get_affinity(int tid);
+
+/**
+ * @brief reserve CPUs, so only threads whose affinity has nothing but
+ * reserved CPUs run on them
+ * @param mask mask of CPUs to reserve, 0 to release all of them
+ * @return 0 on success, negative if no CPU would be left for other threads
+ */
+int reserve_cpus(int mask);
+
+/**
+ * @brief get how many context switches reloaded cr3, which flushes the TLB,
+ * and how many kept it as the next thread shares the address space
+ * @param stats receives the number of reloads and then the number of skips
+ * @return 0 on success, negative on failure
+ */
+int get_cr3_stats(int stats[2]);
+
+#endif /* ASSEMBLER */
+
+#endif /* SYSCALL_EXT_H */
@@ -12,14 +12,10 @@
 
 #include <simics.h>
 #include <syscall.h>
+#include <syscall_ext.h>
 #include <thr_internals.h>
 #include <ureg.h>
 
-/**
- * @brief test if the page fault is caused by page not present
- */
-#define IS_PF_NP(error_code) (((error_code)&0x1) == 0)
-
 /**
  * @brief a stack size which is enough for our swexn handlers
  */
@@ -28,44 +24,17 @@
 char ex_stack[EX_STACK_SIZE];
 void* ex_stack_end = &ex_stack[sizeof(ex_stack)];
 /**
- * @brief a stack size which is enough for common programs
- */
-#define AUTOSYACK_SIZE (1 << 24)
-/**
- * @brief size limit of autostack growth
- */
-const static unsigned int stack_limit = AUTOSYACK_SIZE;
-
-/**
- * @brief autostack swexn handler
- */
-static void swexn_handler(void* arg, ureg_t* reg) {
-    /* check cause */
-    if (reg->cause == SWEXN_CAUSE_PAGEFAULT && IS_PF_NP(reg->error_code)) {
-        /* check stack limit */
-        if (reg->cr2 < main_tcb.stack_lo &&
-            reg->cr2 > main_tcb.stack_lo - stack_limit) {
-            uintptr_t aligned = reg->cr2 & PAGE_ALIGN_MASK;
-            if (new_pages((void*)aligned, (int)(main_tcb.stack_lo - aligned)) !=
-                0) {
-                task_vanish(-2);
-            }
-            main_tcb.stack_lo = aligned;
-            swexn(ex_stack_end, swexn_handler, NULL, reg);
-        }
-    }
-    task_vanish(-2);
-}
-
-/**
- * @brief install autostack handler
+ * @brief install autostack, the kernel grows the initial stack on page faults
+ * up to INITIAL_STACK_LIMIT
+ * @param stack_high top of the initial stack
  */
-void install_autostack(void* stack_high, void* stack_low) {
-    /* use main_tcb to record stack limits */
+void install_autostack(void* stack_high) {
+    /* use main_tcb to record stack limits, the whole area the kernel may grow
+     * the stack into belongs to main thread
+     */
     main_tcb.stack_hi = (unsigned int)stack_high;
-    main_tcb.stack_lo = (unsigned int)stack_low;
+    main_tcb.stack_lo = (unsigned int)stack_high - INITIAL_STACK_LIMIT;
     main_tcb.tid = gettid();
     main_tcb.is_main = 1;
     rb_insert_tcb(&main_tcb);
-    swexn(ex_stack_end, swexn_handler, NULL, NULL);
 }